@@ -2,7 +2,58 @@
 //
 // externals:
 
+#include <string.h>
+
 #include "block_allocator.hpp"
+#include "page_provider.hpp"
+#include "heap_profile.hpp"
+#include "trace_recorder.hpp"
+
+
+//===================================================================================
+//
+// tunables:
+
+// the smallest remainder which is split off a cached memory block when the
+// block is handed out and cached again; smaller remainders stay with the
+// allocated block (the limit is never below the smallest block size)
+#ifndef BLOCK_MIN_SPLIT_SIZE
+#define BLOCK_MIN_SPLIT_SIZE 0x20
+#endif
+
+// the number of bytes of small blocks the owner of a pool keeps in the
+// magazines of the pool, freed but not given back to the bins; the blocks
+// are taken from and given back to the bins by batches (0 disables them)
+#ifndef BLOCK_MAGAZINE_CAPACITY
+#define BLOCK_MAGAZINE_CAPACITY 0x8000
+#endif
+
+// the requests of this many bytes and more are not served by the pools, every
+// such block is mapped on its own and unmapped once it is freed
+#ifndef BLOCK_HUGE_THRESHOLD
+#define BLOCK_HUGE_THRESHOLD 0x100000
+#endif
+
+// define BLOCK_STATS as 0 to stop counting the blocks allocated and freed by
+// every pool; the other counters are kept anyway
+#ifndef BLOCK_STATS
+#define BLOCK_STATS 1
+#endif
+
+// define BLOCK_PROFILE as 0 to compile the sampling heap profile out; otherwise
+// an allocator which is not profiled pays a load and a branch per call
+#ifndef BLOCK_PROFILE
+#define BLOCK_PROFILE 1
+#endif
+
+// define BLOCK_TRACE as 0 to compile the trace recorder out; otherwise an
+// allocator which is not recording pays a load and a branch per call
+#ifndef BLOCK_TRACE
+#define BLOCK_TRACE 1
+#endif
+
+// define BLOCK_REPLACE_OPERATOR_NEW to replace the global operator new and
+// delete (including the sized and the aligned ones) by a BlockAllocator
 
 
 //===================================================================================
@@ -11,9 +62,17 @@
 
 struct m_ctrl_block;
 struct m_pool_local;
+struct m_pool_segment;
+struct m_pool_magazine;
+struct m_huge_block;
+struct m_page_map;
 
-using  p_ctrl_block = m_ctrl_block*;
-using  p_pool_local = m_pool_local*;
+using  p_ctrl_block    = m_ctrl_block*;
+using  p_pool_local    = m_pool_local*;
+using  p_pool_segment  = m_pool_segment*;
+using  p_pool_magazine = m_pool_magazine*;
+using  p_huge_block    = m_huge_block*;
+using  p_page_map      = m_page_map*;
 
 
 //===================================================================================
@@ -21,24 +80,36 @@ using  p_pool_local = m_pool_local*;
 // publics:
 
 // This is a data structure which is used as a "service" header for user memory
-// block. 
+// block. An allocated block pays only for m_data: m_head is valid only while
+// the previous block is free, otherwise it holds the tail of the previous
+// block's user memory; the bins linkage overlays the user memory and is valid
+// only while the block is free (dlmalloc style). The pool of a block is found
+// from its address by the page map of the allocator. m_data is accessed
+// atomically, though without ordering: a thread other than the owner of the
+// pool reads the size of the blocks it holds, while the owner may flip PBit
+// of these blocks as their neighbours are allocated and freed.
 struct m_ctrl_block
 {
-	size_t       m_head; // stores the size of the previos memory block
-	size_t       m_data; // stores the size of the current memory block + 
-		                 // 2 less significant bits used as flags: whether
-						 // the current block and the previous block are in use
-
-	p_pool_local m_pool; // parent memory pool
-
-	size_t       m_indx; // index in the array of trees
+	enum
+	{
+		HeadSize = 2 * sizeof(size_t), // m_head and m_data precede the user memory
+		Overhead = 1 * sizeof(size_t), // the bytes an allocated block pays on top of the user memory
+		MinSize  = 4 * sizeof(size_t)  // the smallest block still holds m_next and m_prev once it is free
+	};
 
+	size_t               m_head; // stores the size of the previos memory block
+	ATOMIC_VALUE(size_t) m_data; // stores the size of the current memory block + 
+		                         // 2 less significant bits used as flags: whether
+						         // the current block and the previous block are in use
 	p_ctrl_block m_next; // each node of the tree represent itself a linked list
 	p_ctrl_block m_prev; // of memory blocks of the same size
 
 	p_ctrl_block m_limb[2]; // left and right childs
 	p_ctrl_block m_parent;  // parent node
 
+	size_t       m_indx; // index in the array of trees
+	size_t       m_trim; // whether pages of the free block past its header may have been decommitted
+
 	INLINE size_t head()
 	{
 		return m_head;
@@ -49,24 +120,24 @@ struct m_ctrl_block
 		m_head = head;
 	}
 
-	INLINE size_t size()
+	INLINE size_t data()
 	{
-		return m_data & (~CBit) & (~PBit);
+		return m_data.load(std::memory_order_relaxed);
 	}
 
-	INLINE void size(size_t size)
+	INLINE void data(size_t data)
 	{
-		m_data = (m_data & (CBit | PBit)) | (size & (~CBit) & (~PBit));
+		m_data.store(data, std::memory_order_relaxed);
 	}
 
-	INLINE p_pool_local pool()
+	INLINE size_t size()
 	{
-		return m_pool;
+		return data() & (~CBit) & (~PBit);
 	}
 
-	INLINE void pool(p_pool_local pool)
+	INLINE void size(size_t size)
 	{
-		m_pool = pool;
+		data((data() & (CBit | PBit)) | (size & (~CBit) & (~PBit)));
 	}
 
 	INLINE size_t indx()
@@ -81,22 +152,22 @@ struct m_ctrl_block
 
 	INLINE size_t pbit() // flag, whether the previous control memory block is in use
 	{
-		return m_data & PBit;
+		return data() & PBit;
 	}
 
 	INLINE size_t cbit() // flag, whether the current control memory block is in use
 	{
-		return m_data & CBit;
+		return data() & CBit;
 	}
 
 	INLINE void turn(size_t bit)
 	{
-		m_data |= bit;
+		data(data() | bit);
 	}
 
 	INLINE void drop(size_t bit)
 	{
-		m_data &= ~bit;
+		data(data() & ~bit);
 	}
 
 	INLINE p_ctrl_block next_blck()
@@ -116,7 +187,12 @@ struct m_ctrl_block
 
 	INLINE void* user_addr() //return pointer to user memory
 	{
-		return reinterpret_cast<char*>(this) + sizeof(m_ctrl_block);
+		return reinterpret_cast<char*>(this) + HeadSize;
+	}
+
+	INLINE size_t user_size() //the user memory ends with m_head of the next block
+	{
+		return size() - Overhead;
 	}
 
 	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_ctrl_block);
@@ -129,562 +205,3108 @@ struct m_ctrl_block
 // memory block
 INLINE static p_ctrl_block mem_to_blk(void* mem)
 {
-	return sub_mem<p_ctrl_block>(mem, sizeof(m_ctrl_block));
+	return sub_mem<p_ctrl_block>(mem, m_ctrl_block::HeadSize);
+}
+
+// this routine returns a token which identifies the calling thread
+// among the live threads
+INLINE static const void* thread_token()
+{
+	THREAD_LOCAL(char) token;
+	return &token;
+}
+
+// these routines update a counter only one thread writes at a time: the owner
+// of a pool, or the thread holding the lock of a pool nobody owns; so there is
+// no read-modify-write, the other threads only read the counter
+INLINE static void stat_add(ATOMIC_VALUE(size_t)& counter, size_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+INLINE static void stat_sub(ATOMIC_VALUE(size_t)& counter, size_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) - value, std::memory_order_relaxed);
 }
 
 
 
 ////////////////////////////////////////////////////////////////////////////////
 
-// This data structure describes a unique memory pool.
-struct m_pool_local
+// This data structure describes a contiguous range of reserved address space
+// used by a memory pool; the first segment is embedded into the pool header,
+// the chained ones are placed at the beginning of their ranges.
+struct m_pool_segment
 {
-	enum
+	char*          m_addr; // beginning of the reserved range
+	size_t         m_size; // size of the reserved range
+	p_ctrl_block   m_blck; // first memory block in the segment
+	p_pool_segment m_next; // segment chained before this one
+
+	INLINE char* end()
 	{
-		Count = 32,
-		MaxTinyRequest = 256
-	};
+		return m_addr + m_size;
+	}
 
-	LOCK         m_lock; // mutex to lock the whole pool
-	p_ctrl_block m_foot; // free control memory block which is used to allocate new memory blocks
+	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_pool_segment);
+};
 
-	uint32_t     m_tinybits; // binary map used to indicate what bins are in the use
-	m_ctrl_block m_tinybins[Count]; // array of lists used to cache already freed small memory blocks
 
-	uint32_t     m_treebits; // binary map used to indicate what bins are in the use
-	p_ctrl_block m_treebins[Count]; // array of binary trees used to cache already freed large memory blocks
+////////////////////////////////////////////////////////////////////////////////
 
-	p_pool_local m_next; // link to next memory pool in this allocator
-	
-	INLINE void init(size_t foot_size)
+// This data structure caches the small blocks of one size freed by the owner
+// of a pool. The blocks stay in use as far as the bins are concerned, they are
+// linked through their user memory; so a malloc/free pair served by the
+// magazine touches neither the bins nor anything the other threads write.
+struct m_pool_magazine
+{
+	p_ctrl_block m_head;  // the last block put into the magazine
+	size_t       m_count; // number of the blocks in the magazine
+
+	INLINE void push(p_ctrl_block blck)
 	{
-		m_tinybits = 0;
-		m_treebits = 0;
+		blck->m_next = m_head;
+		m_head = blck;
+		m_count += 1;
+	}
 
-		m_lock.mutex::mutex();
+	INLINE p_ctrl_block pull()
+	{
+		p_ctrl_block blck = m_head;
 
-		m_foot = add_mem<p_ctrl_block>(this, sizeof(m_pool_local));
+		m_head = blck->m_next;
+		m_count -= 1;
 
-		m_foot->size(foot_size - sizeof(m_pool_local));
-		m_foot->turn(PBit);
+		return blck;
 	}
 
-	INLINE void fini()
-	{
-		assert(m_foot == add_mem<p_ctrl_block>(this, sizeof(m_pool_local)));
-	}
+	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_pool_magazine);
+};
 
-	// this routine tries to allocate memory block; 
-	// first it looks to the binary maps for suitable memory block,
-	// and later if there is enough memory is allocates a new block
-	// from the foots
-	void* malloc(size_t bytesreq)
-	{
-		if (!m_lock.try_lock())
-			return VOID_0;
 
-		SCOPE_LOCK_AFTER_TRY(m_lock);
+////////////////////////////////////////////////////////////////////////////////
 
-		void* mem = NULL;
+// This data structure is the header of a huge block, which is mapped on its own
+// by the allocator rather than served by a pool. The range of the block is
+// reserved by whole grains of the page map and entered into it under the huge
+// mark; only the pages the block spans are committed. The header immediately
+// precedes the user memory, which is aligned as requested.
+struct m_huge_block
+{
+	enum
+	{
+		Threshold = BLOCK_HUGE_THRESHOLD // the smallest request served by a huge block
+	};
 
-		size_t size = (bytesreq + sizeof(m_ctrl_block) + 0x7) & ~0x7; //adjusting the size to double word boundary
+	char*  m_addr; // beginning of the reserved range
+	size_t m_size; // size of the reserved range
+	size_t m_used; // bytes committed from the beginning of the range
+	size_t m_user; // bytes requested by the user
 
-		size_t treeindx = calc_tree_bins_indx(size);
-		size_t tinyindx = calc_tiny_bins_indx(size);
+	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_huge_block);
+};
 
-		assert(((m_tinybits>>tinyindx) & (m_treebits>>treeindx)) == 0);
+// this routine is used to convert user memory to the header of a huge block
+INLINE static p_huge_block mem_to_huge(void* mem)
+{
+	return sub_mem<p_huge_block>(mem, sizeof(m_huge_block));
+}
 
-		if ((bytesreq < MaxTinyRequest) && ((m_tinybits >> tinyindx) & 1u))
-		{
-			mem = call_tiny_bins_malloc(size);
-		}
-		else if ((m_treebits >> treeindx) & 1u)
-		{
-			mem = call_tree_bins_malloc(size);
-		}
-		else if (size < m_foot->size())
-		{
-			mem = call_foot_pool_malloc(size);
-		}
-				
-		return (mem != NULL) ? mem : VOID_1;
-	}
 
-	// this routine releases allocated memory block; it tries to coalesce
-	// it with the previous or the next block, and then caches the result
-	// in the binary map
-	void free(void* p)
+////////////////////////////////////////////////////////////////////////////////
+
+// This data structure maps the address space to the pools owning it by grains
+// of GrainSize bytes: the ranges of the pools are reserved aligned to the grains
+// and sized by them, so every grain belongs to one pool at most. It is a radix
+// tree of two levels; the leaves are allocated as the ranges are entered and
+// published with a CAS, the lookup takes no lock.
+struct m_page_map
+{
+	enum
 	{
-		SCOPE_LOCK(m_lock);		
+		GrainShift  = 22,
+		GrainSize   = 1 << GrainShift,
+		AddressBits = (sizeof(void*) > 4) ? 48 : 32,
+		IndexBits   = AddressBits - GrainShift,
+		LeafBits    = IndexBits / 2,
+		LeafSize    = 1 << LeafBits,
+		RootSize    = 1 << (IndexBits - LeafBits)
+	};
 
-		p_ctrl_block curr_b = mem_to_blk(p);
-		size_t       curr_s = curr_b->size();
+	using p_page_leaf = ATOMIC_VALUE(p_pool_local)*;
+	ATOMIC_VALUE(p_page_leaf) m_root[RootSize];
 
-		assert(curr_b->pool() == this);
+	// the grains of the huge blocks are entered as owned by this mark
+	INLINE static p_pool_local huge_mark()
+	{
+		return reinterpret_cast<p_pool_local>(VOID_1);
+	}
 
-		if (!curr_b->cbit())
-			return;
+	// returns the pool owning the address, or NULL if the address
+	// does not belong to any pool of the allocator
+	INLINE p_pool_local find(void* mem)
+	{
+		size_t indx = reinterpret_cast<size_t>(mem) >> GrainShift;
 
-		p_ctrl_block next_b = curr_b->next_blck();
-		size_t       next_s = next_b->size();
+		if (indx >> IndexBits)
+			return NULL;
 
-		if (!curr_b->pbit()) //coalesce with previous block
-		{
-			size_t       prev_s = curr_b->head();
-			p_ctrl_block prev_b = curr_b->prev_blck();
+		p_page_leaf leaf = m_root[indx >> LeafBits].load(std::memory_order_acquire);
+		if (!leaf)
+			return NULL;
 
-			if (prev_s < MaxTinyRequest)
-			{
-				pull_tiny_bins_blck(prev_b);
-			}
-			else
-			{
-				pull_tree_bins_blck(prev_b);
-			}
+		return leaf[indx & (LeafSize - 1)].load(std::memory_order_acquire);
+	}
 
-			curr_b = prev_b;
-			curr_s += prev_s;
-		}
+	// enters the range as owned by the pool, a NULL pool removes it; the range
+	// is aligned and sized by the grains; fails if a leaf cannot be allocated
+	bool insert(void* addr, size_t size, p_pool_local pool)
+	{
+		size_t head = reinterpret_cast<size_t>(addr) >> GrainShift;
+		size_t tail = (reinterpret_cast<size_t>(addr) + size) >> GrainShift;
 
-		if (!next_b->cbit()) //coalesce with next block
+		if (tail > ((size_t)1 << IndexBits))
+			return false;
+
+		for (size_t indx = head; indx < tail; indx++)
 		{
-			curr_s += next_s;
+			ATOMIC_VALUE(p_page_leaf)& slot = m_root[indx >> LeafBits];
 
-			if (next_b == m_foot)
+			p_page_leaf leaf = slot.load(std::memory_order_acquire);
+			if (!leaf)
 			{
-				m_foot = curr_b;
-				m_foot->size(curr_s);
-				m_foot->turn(PBit);
-				m_foot->drop(CBit);
+				if (!pool)
+					continue;
 
-				return;
-			}
-			
+				// fresh pages are zero filled, that is a leaf of NULL pools
+				p_page_leaf fresh = static_cast<p_page_leaf>(page_alloc(sizeof(leaf[0]) * LeafSize));
+				if (!fresh)
+					return false;
 
-			if (next_s < MaxTinyRequest)
-			{
-				pull_tiny_bins_blck(next_b);
-			}
-			else
-			{
-				pull_tree_bins_blck(next_b);
+				if (slot.compare_exchange_strong(leaf, fresh, std::memory_order_acq_rel))
+				{
+					leaf = fresh;
+				}
+				else
+				{
+					page_free(fresh, sizeof(leaf[0]) * LeafSize);
+				}
 			}
-			
-		}
-						
-		curr_b->drop(CBit);
-		curr_b->size(curr_s);
-		curr_b->next_blck()->drop(PBit);
-		curr_b->next_blck()->head(curr_s);
 
-		if (curr_s < MaxTinyRequest)
-		{
-			push_tiny_bins_blck(curr_b);
-		}
-		else
-		{
-			push_tree_bins_blck(curr_b);
+			leaf[indx & (LeafSize - 1)].store(pool, std::memory_order_release);
 		}
+
+		return true;
 	}
 
-	INLINE p_ctrl_block find_tiny_bins_blck(size_t indx)
+	INLINE void erase(void* addr, size_t size)
 	{
-		assert(indx < Count);
-		return &m_tinybins[indx];
+		insert(addr, size, NULL);
 	}
 
-	INLINE p_ctrl_block find_tree_bins_blck(size_t indx)
+	// frees the leaves, all the ranges are removed by now
+	INLINE void fini()
 	{
-		assert(indx < Count);
-		return m_treebins[indx];
+		for (size_t i = 0; i < RootSize; i++)
+		{
+			p_page_leaf leaf = m_root[i].load(std::memory_order_relaxed);
+			if (leaf)
+				page_free(leaf, sizeof(leaf[0]) * LeafSize);
+		}
 	}
 
-	// the index in the array of linked lists; 
-	// map size value to the array of 32 bins;
-	INLINE size_t calc_tiny_bins_indx(size_t size)
-	{
-		return size >> 3;
-	}	
+	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_page_map);
+};
 
-	// the index in the array of trees is the most 
-	// significant bit of the size
-	INLINE size_t calc_tree_bins_indx(size_t size)
-	{
-		DWORD indx;
-		BSR(&indx, size);
 
-		return indx;
-	}
+////////////////////////////////////////////////////////////////////////////////
 
-	// takes the first block in the specified linked list
-	INLINE void* call_tiny_bins_malloc(size_t size)
+// This data structure describes a unique memory pool.
+struct m_pool_local
+{
+	enum
 	{
-		size_t indx = calc_tiny_bins_indx(size);
-		assert((find_tiny_bins_blck(indx)->m_next != find_tiny_bins_blck(indx)) && (find_tiny_bins_blck(indx)->m_prev != find_tiny_bins_blck(indx)));
-
-		p_ctrl_block blck = find_tiny_bins_blck(indx)->m_next;
+		Count = 32,
+		MaxTinyRequest = 256,
 
-		blck->pool(this);
-		blck->turn(CBit);
-		blck->turn(PBit);
+		MinSplitSize = (BLOCK_MIN_SPLIT_SIZE > m_ctrl_block::MinSize) ? BLOCK_MIN_SPLIT_SIZE : m_ctrl_block::MinSize,
+		MinAlignment = m_ctrl_block::HeadSize, // the alignment of the user memory of every block, the sizes of the blocks are rounded to it
 
-		pull_tiny_bins_blck(blck);
-		return blck->user_addr();
-	}
-		
-	// tries to find the most suitable memory block in the
-	// specified binary tree
-	INLINE void* call_tree_bins_malloc(size_t size)
-	{
-		p_ctrl_block topt = find_tree_bins_blck(calc_tree_bins_indx(size));
-		p_ctrl_block blck = topt;
+		FenceSize  = 2 * sizeof(size_t), // the block sealing the end of a segment carries only m_head and m_data
+		CommitSize = 0x10000,            // granularity the reserved memory is committed with
+		TrimSize   = 0x100000,           // amount of committed memory above the foot which is given back to the OS
+		MaxSize    = 0x40000000,         // the largest range of a pool; with the requests below the huge threshold, alignment included, the free blocks fit the 32 trees
 
-		size_t rsize = topt->size() - size;
+		MagazineCapacity = BLOCK_MAGAZINE_CAPACITY, // bytes of the blocks cached in the magazines at most
+		MagazineBatch    = 0x10,                    // blocks a magazine is refilled with, or gives back, at once
+		MagazineDepth    = 2 * MagazineBatch        // blocks a magazine holds at most
+	};
 
-		while (topt = topt->left_most_limb())
-		{
-			size_t srem = topt->size() - size;
-			if (srem < rsize)
-			{
-				rsize = srem;
-				blck = topt;
-			}
-		}
+	// the fields the other threads touch come first, on lines of their own:
+	// the read mostly ones, the lock and the list of the remote blocks
 
-		pull_tree_bins_blck(blck);
+	alignas(CACHE_LINE) ATOMIC_VALUE(const void*) m_owner; // token of the thread owning the pool, the owner never locks the pool
 
-		blck->pool(this);
-		blck->turn(CBit);
-		blck->turn(PBit);
+	size_t       m_indx; // index of the pool in the directory of its allocator
+	p_page_map   m_map;  // the page map of the allocator, the segments of the pool are entered into it
 
-		return blck->user_addr();
-	}
+	alignas(CACHE_LINE) LOCK m_lock; // mutex to lock the whole pool
 
-	// allocates a new memory block on the foot
-	INLINE void* call_foot_pool_malloc(size_t size)
-	{
-		size_t rest = m_foot->size() - size;
+	ATOMIC_VALUE(size_t) m_lockfails; // times the other threads found the pool locked
 
-		p_ctrl_block blck = m_foot;
-		blck->pool(this);
-		blck->size(size);
-		blck->turn(CBit);
+	alignas(CACHE_LINE) ATOMIC_VALUE(p_ctrl_block) m_remote; // list of blocks freed by the other threads, drained by the owner
 
-		m_foot = blck->next_blck();
-		m_foot->size(rest);
-		m_foot->head(size);
-		m_foot->turn(PBit);
-		m_foot->drop(CBit);
+	ATOMIC_VALUE(size_t) m_remotes; // blocks freed by the other threads
 
-		return blck->user_addr();
-	}	
+	// the fields below are touched only by the owner, or by a thread
+	// holding the lock of a pool nobody owns
 
-	// add memory block to the specified linked list
-	INLINE void push_tiny_bins_blck(p_ctrl_block blck)
-	{
-		size_t size = blck->size();
-		size_t indx = calc_tiny_bins_indx(size);
+	alignas(CACHE_LINE) p_ctrl_block m_foot; // free control memory block which is used to allocate new memory blocks
 
-		assert(indx < Count);
+	char*        m_tail; // end of the committed memory in the segment of the foot
 
-		p_ctrl_block prev = find_tiny_bins_blck(indx);
-		p_ctrl_block next = prev;
+	m_pool_segment m_segment;  // the segment the pool header resides in
+	p_pool_segment m_segments; // list of all segments of the pool, the segment of the foot comes first
 
-		prev->m_next = blck;
-		next->m_prev = blck;
-		blck->m_next = next;
-		blck->m_prev = prev;
+	uint32_t     m_tinybits; // binary map used to indicate what bins are in the use
+	m_ctrl_block m_tinybins[Count]; // array of lists used to cache already freed small memory blocks
 
-		m_tinybits |= ((size_t)1 << indx);
-	}
+	uint32_t     m_treebits; // binary map used to indicate what bins are in the use
+	p_ctrl_block m_treebins[Count]; // array of binary trees used to cache already freed large memory blocks
 
-	// add memory block to the tree
-	INLINE void push_tree_bins_blck(p_ctrl_block blck)
+	m_pool_magazine m_magazines[Count]; // blocks freed by the owner, by the sizes of the tiny bins; only the owner touches them
+
+	// the statistics; they are written the same way as the fields above,
+	// see stat_add, and read by any thread
+	ATOMIC_VALUE(size_t) m_cached;             // bytes of the blocks cached in the magazines
+	ATOMIC_VALUE(size_t) m_tinybytes;          // bytes of the blocks cached in the tiny bins
+	ATOMIC_VALUE(size_t) m_treebytes;          // bytes of the blocks cached in the tree bins
+	ATOMIC_VALUE(size_t) m_footbytes;          // bytes carved from the foot
+	ATOMIC_VALUE(size_t) m_coalesced;          // free blocks merged with their neighbours
+	ATOMIC_VALUE(size_t) m_foreign;            // blocks allocated by the threads which do not own the pool
+	ATOMIC_VALUE(size_t) m_segcount;           // segments of the pool
+	ATOMIC_VALUE(size_t) m_segbytes;           // bytes reserved by the segments
+	ATOMIC_VALUE(size_t) m_mallocs[2 * Count]; // blocks allocated by the bins of their sizes, the tiny bins first
+	ATOMIC_VALUE(size_t) m_frees[2 * Count];   // blocks freed by the bins of their sizes
+	
+	// the pool is placed at the beginning of the reserved range of the specified
+	// size, only the first commit_size bytes of the range are committed
+	INLINE void init(p_page_map map, size_t size, size_t commit_size)
 	{
-		size_t size = blck->size();
-		size_t indx = calc_tree_bins_indx(size);
+		m_map = map;
 
-		blck->indx(indx);
-
-		blck->m_limb[0] = NULL;
-		blck->m_limb[1] = NULL;
+		m_tinybits = 0;
+		m_treebits = 0;
 
-		size_t mask = (size_t)1u << indx;
-		if ((m_treebits & mask) == 0)
+		for (size_t i = 0; i < Count; i++)
 		{
-			m_treebits |= mask;
-			m_treebins[indx] = blck;
+			m_magazines[i].m_head  = NULL;
+			m_magazines[i].m_count = 0;
+		}
 
-			blck->m_parent = m_treebins[indx];
+		new (&m_lockfails) ATOMIC_VALUE(size_t)(0);
+		new (&m_remotes) ATOMIC_VALUE(size_t)(0);
 
-			blck->m_next = blck;
-			blck->m_prev = blck;
+		new (&m_cached) ATOMIC_VALUE(size_t)(0);
+		new (&m_tinybytes) ATOMIC_VALUE(size_t)(0);
+		new (&m_treebytes) ATOMIC_VALUE(size_t)(0);
+		new (&m_footbytes) ATOMIC_VALUE(size_t)(0);
+		new (&m_coalesced) ATOMIC_VALUE(size_t)(0);
+		new (&m_foreign) ATOMIC_VALUE(size_t)(0);
+		new (&m_segcount) ATOMIC_VALUE(size_t)(1);
+		new (&m_segbytes) ATOMIC_VALUE(size_t)(size);
 
-			return;
+		for (size_t i = 0; i < 2 * Count; i++)
+		{
+			new (&m_mallocs[i]) ATOMIC_VALUE(size_t)(0);
+			new (&m_frees[i]) ATOMIC_VALUE(size_t)(0);
 		}
 
-		p_ctrl_block topt = find_tree_bins_blck(indx);
+		new (&m_lock) LOCK();
 
-		for (;;)
+		new (&m_owner) ATOMIC_VALUE(const void*)(NULL);
+		new (&m_remote) ATOMIC_VALUE(p_ctrl_block)(NULL);
+
+		// init list bins
+		for (size_t i = 0; i < Count; i++)
+			m_tinybins[i].m_next = m_tinybins[i].m_prev = find_tiny_bins_blck(i);
+
+		m_segment.m_addr = reinterpret_cast<char*>(this);
+		m_segment.m_size = size;
+		m_segment.m_blck = add_mem<p_ctrl_block>(this, sizeof(m_pool_local));
+		m_segment.m_next = NULL;
+
+		m_segments = &m_segment;
+		m_tail = m_segment.m_addr + commit_size;
+
+		m_foot = m_segment.m_blck;
+
+		m_foot->size(size - sizeof(m_pool_local) - FenceSize);
+		m_foot->turn(PBit);
+	}
+
+	// releases the chained segments, the segment embedded into
+	// the pool header is released along with the pool
+	INLINE void fini()
+	{
+		drain_remote_blcks();
+		flush_magazines();
+
+		for (size_t i = 0; i < Count; i++)
 		{
-			size_t H = (size_t)1u << 31u;
-			size_t R = size << (31u - indx);
+			assert(m_tinybins[i].m_next == m_tinybins[i].m_prev);
+			assert(m_tinybins[i].m_next == find_tiny_bins_blck(i));
+		}
+		assert(m_foot == m_segments->m_blck);
 
-			if (topt->size() != size)
-			{
-				p_ctrl_block* c = &topt->m_limb[R & H];
-				R <<= 1;
+		while (m_segments != &m_segment)
+		{
+			p_pool_segment segment = m_segments;
+			m_segments = segment->m_next;
 
-				if (*c)
-				{
-					topt = *c;
-				}
-				else
-				{
-					*c = blck;
+			m_map->erase(segment->m_addr, segment->m_size);
+			page_free(segment->m_addr, segment->m_size);
+		}
+	}
 
-					blck->m_parent = topt;
+	// reports the blocks of every segment up to the fence sealing it, or up to
+	// the foot, which is reported as the last block of its segment
+	bool walk(BlockAllocator::WalkCallback callback, void* context)
+	{
+		BlockAllocator::BlockInfo info;
+		info.m_Pool = m_indx;
 
-					blck->m_next = blck;
-					blck->m_prev = blck;
+		for (p_pool_segment segment = m_segments; segment; segment = segment->m_next)
+		{
+			p_ctrl_block blck = segment->m_blck;
 
-					break;
-				}
+			for (; blck != m_foot && blck->size(); blck = blck->next_blck())
+			{
+				info.m_Addr = blck->user_addr();
+				info.m_Size = blck->size();
+				info.m_Used = blck->cbit() != 0;
+				info.m_Foot = false;
+
+				if (!callback(info, context))
+					return false;
 			}
-			else
+
+			if (blck == m_foot)
 			{
-				p_ctrl_block next = topt->m_next;
+				info.m_Addr = blck->user_addr();
+				info.m_Size = blck->size();
+				info.m_Used = false;
+				info.m_Foot = true;
 
-				topt->m_next = blck;
-				next->m_prev = blck;
+				if (!callback(info, context))
+					return false;
+			}
+		}
 
-				blck->m_next = next;
-				blck->m_prev = topt;
+		return true;
+	}
 
-				blck->m_parent = NULL;
-				break;
+	// binds the pool to the calling thread unless it is owned by another thread
+	INLINE bool claim(const void* token)
+	{
+		SCOPE_LOCK(m_lock);
+
+		if (!m_owner.load(std::memory_order_relaxed))
+			m_owner.store(token, std::memory_order_relaxed);
+
+		return m_owner.load(std::memory_order_relaxed) == token;
+	}
+
+	// unbinds the pool from its owner, which is exiting; the pool is
+	// claimed by the next thread binding to the allocator, until then
+	// the other threads allocate from it under its lock. The blocks freed
+	// remotely are taken back and the committed memory above the foot is
+	// given back to the OS, since nobody may allocate from the pool soon
+	INLINE void release()
+	{
+		SCOPE_LOCK(m_lock);
+
+		drain_remote_blcks();
+		flush_magazines();
+		trim_foot_pool(0);
+
+		m_owner.store(NULL, std::memory_order_relaxed);
+	}
+
+	// this routine is used by the owner of the pool; the pool is not locked.
+	// Small blocks are served by the magazines, the other requests take the
+	// blocks freed by the other threads back first; when the pool runs out of
+	// memory the magazines are given back to the bins and the request retried
+	INLINE void* local_malloc(size_t bytesreq, size_t alignment)
+	{
+		if (alignment <= MinAlignment && bytesreq < MaxTinyRequest)
+		{
+			size_t size = calc_blck_size(bytesreq);
+
+			if (size < MaxTinyRequest && size <= MagazineCapacity)
+			{
+				void* mem = call_magazine_malloc(size);
+				if (mem)
+				{
+					stat_malloc(mem);
+					return mem;
+				}
 			}
 		}
+
+		if (m_remote.load(std::memory_order_relaxed))
+			drain_remote_blcks();
+
+		void* mem = call_pool_malloc(bytesreq, alignment);
+
+		if (!mem && m_cached.load(std::memory_order_relaxed))
+		{
+			flush_magazines();
+			mem = call_pool_malloc(bytesreq, alignment);
+		}
+
+		if (mem)
+			stat_malloc(mem);
+
+		return mem;
 	}
 
-	// remove memory block from the specified linked list
-	INLINE void pull_tiny_bins_blck(p_ctrl_block blck)
+	// this routine is used by the threads which do not own the pool;
+	// they may allocate only from a pool nobody owns, under its lock.
+	// The owner is tested before the lock, so the lines of the pools
+	// in use are only read by the other threads passing by
+	void* malloc(size_t bytesreq, size_t alignment)
 	{
-		p_ctrl_block lblk = static_cast<p_ctrl_block>(blck);
+		if (m_owner.load(std::memory_order_relaxed))
+			return VOID_1;
 
-		size_t size = lblk->size();
-		size_t indx = calc_tiny_bins_indx(size);
+		if (!m_lock.try_lock())
+		{
+			m_lockfails.fetch_add(1, std::memory_order_relaxed);
+			return VOID_0;
+		}
 
-		assert(indx < Count);
+		SCOPE_LOCK_AFTER_TRY(m_lock);
 
-		p_ctrl_block next = blck->m_next;
-		p_ctrl_block prev = blck->m_prev;
+		if (m_owner.load(std::memory_order_relaxed))
+			return VOID_1;
 
-		if (next == prev) // drop bits
-			m_tinybits &= ~((size_t)1 << indx);
+		drain_remote_blcks();
 
-		next->m_prev = prev;
-		prev->m_next = next;
+		void* mem = call_pool_malloc(bytesreq, alignment);
+		if (mem == NULL)
+			return VOID_1;
+
+		stat_malloc(mem);
+		stat_add(m_foreign, 1);
+
+		return mem;
 	}
 
-	// remove memory block from the tree
-	INLINE void pull_tree_bins_blck(p_ctrl_block blck)
+	// the owner frees the block straight away; a pool nobody owns is
+	// locked to free it, otherwise the block is handed over to the owner.
+	// size is the size of the block as the caller knows it (see free_sized),
+	// so that the owner picks the magazine without reading the header; 0 if
+	// the caller does not know it
+	void free(void* p, size_t size)
 	{
-		p_ctrl_block prnt = blck->m_parent;
-		p_ctrl_block temp = NULL;
+		const void* owner = m_owner.load(std::memory_order_relaxed);
 
-		if (blck->m_prev != blck)
+		if (owner == thread_token())
 		{
-			p_ctrl_block next = blck->m_next;
-			p_ctrl_block prev = blck->m_prev;
+			if (!size)
+				size = mem_to_blk(p)->size();
 
-			next->m_prev = prev;
-			prev->m_next = next;
+			stat_free(size);
+			call_magazine_free(p, size);
+		}
+		else if (!owner && try_lock())
+		{
+			SCOPE_LOCK_AFTER_TRY(m_lock);
 
-			temp = prev;
+			if (m_owner.load(std::memory_order_relaxed))
+			{
+				push_remote_blck(mem_to_blk(p));
+			}
+			else
+			{
+				stat_free(size ? size : mem_to_blk(p)->size());
+				call_pool_free(p);
+			}
 		}
 		else
 		{
-			p_ctrl_block* up;
-			if ((temp = *(up = &(blck->m_limb[1]))) || (temp = *(up = &(blck->m_limb[0]))))
+			push_remote_blck(mem_to_blk(p));
+		}
+	}
+
+	// frees the blocks of the pool the same way as free(), though the pool
+	// is locked once and the blocks are handed over to the owner at once
+	void free_batch(void** p, size_t count)
+	{
+		const void* owner = m_owner.load(std::memory_order_relaxed);
+
+		if (owner == thread_token())
+		{
+			for (size_t i = 0; i < count; i++)
 			{
-				p_ctrl_block* vp;
-				while (*(vp = &(temp->m_limb[1])) || *(vp = &(temp->m_limb[0])))
-				{
-					temp = *(up = vp);
-				}
+				size_t size = mem_to_blk(p[i])->size();
 
-				*up = 0;
-			}								
+				stat_free(size);
+				call_magazine_free(p[i], size);
+			}
 		}
-
-		if (prnt)
+		else if (!owner && try_lock())
 		{
-			size_t indx = blck->indx();
-			p_ctrl_block* t = &m_treebins[indx];
+			SCOPE_LOCK_AFTER_TRY(m_lock);
 
-			if (blck == *t)
+			if (m_owner.load(std::memory_order_relaxed))
 			{
-				if ((*t = temp) == 0)
-				{
-					m_treebits &= ~((size_t)1u << indx);
-				}
+				push_remote_blcks(p, count);
 			}
 			else
 			{
-				if (prnt->m_limb[0] == blck)
-				{
-					prnt->m_limb[0] = temp;
-				}
-				else
+				for (size_t i = 0; i < count; i++)
 				{
-					prnt->m_limb[1] = temp;
+					stat_free(mem_to_blk(p[i])->size());
+					call_pool_free(p[i]);
 				}
 			}
+		}
+		else
+		{
+			push_remote_blcks(p, count);
+		}
+	}
 
-			if (temp)
-			{
-				p_ctrl_block cld0, cld1;
-				temp->m_parent = prnt;
+	// this routine is used by the owner of the pool to allocate a number of
+	// blocks of the same size; returns the number of the blocks allocated
+	INLINE size_t local_malloc_batch(size_t bytesreq, size_t count, void** p)
+	{
+		if (m_remote.load(std::memory_order_relaxed))
+			drain_remote_blcks();
 
-				if (cld0 = blck->m_limb[0])
-				{
-					temp->m_limb[0] = cld0;
-					cld0->m_parent  = temp;
-				}
-				if (cld1 = blck->m_limb[1])
-				{
-					temp->m_limb[1] = cld1;
-					cld1->m_parent  = temp;
-				}
-			}
+		size_t done = call_pool_malloc_batch(bytesreq, count, p);
+
+		for (size_t i = 0; i < done; i++)
+			stat_malloc(p[i]);
+
+		return done;
+	}
+
+	// resizes the block in place, returns NULL if it has to be moved; only
+	// the owner or a thread holding the lock of a pool nobody owns may
+	// change the neighbours of the block, otherwise the block may only
+	// stay as it is when it is shrunk
+	void* realloc(void* p, size_t bytesreq)
+	{
+		const void* owner = m_owner.load(std::memory_order_relaxed);
+
+		if (owner == thread_token())
+		{
+			return call_pool_realloc(p, bytesreq) ? p : NULL;
+		}
+		else if (!owner && try_lock())
+		{
+			SCOPE_LOCK_AFTER_TRY(m_lock);
+
+			if (!m_owner.load(std::memory_order_relaxed))
+				return call_pool_realloc(p, bytesreq) ? p : NULL;
 		}
+
+		return (mem_to_blk(p)->user_size() >= bytesreq) ? p : NULL;
 	}
 
-	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_pool_local);
-};
+	// the lock is tried by the threads other than the owner, the failures are counted
+	INLINE bool try_lock()
+	{
+		if (m_lock.try_lock())
+			return true;
 
+		m_lockfails.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
 
-//===================================================================================
-//
-//
+	// the bin of the statistics the block falls into: the tiny bins by 8 bytes,
+	// then the trees by the powers of two
+	INLINE static size_t calc_stat_bins_indx(size_t size)
+	{
+		return (size < MaxTinyRequest) ? calc_tiny_bins_indx(size) : Count + calc_tree_bins_indx(size);
+	}
 
-BlockAllocator::BlockAllocator(size_t thread_local_capacity)
-	: m_ThreadCount(0)
-{
-	// construct thread local memory pools
-	for (size_t i = 0; i < MaxThreadCount; i++)
+	INLINE void stat_malloc(void* p)
 	{
-		m_ThreadPool[i] = pool_construct(thread_local_capacity);		
+		if (BLOCK_STATS)
+			stat_add(m_mallocs[calc_stat_bins_indx(mem_to_blk(p)->size())], 1);
 	}
-	for (size_t i = 0; i < MaxThreadCount; i++)
+
+	INLINE void stat_free(size_t size)
 	{
-		assert(m_ThreadPool[i]);
+		if (BLOCK_STATS)
+			stat_add(m_frees[calc_stat_bins_indx(size)], 1);
 	}
-	for (size_t i = 0; i < MaxThreadCount - 1; i++)
+
+	// adds the block freed by a thread other than the owner to the list of
+	// remote blocks; the block is linked through its user memory and stays
+	// in use until the list is drained
+	INLINE void push_remote_blck(p_ctrl_block blck)
 	{
-		m_ThreadPool[i]->m_next = m_ThreadPool[i + 1];
+		m_remotes.fetch_add(1, std::memory_order_relaxed);
+		push_remote_blcks(blck, blck);
 	}
-	m_ThreadPool[MaxThreadCount - 1]->m_next = m_ThreadPool[0];
-}
 
+	// adds the blocks linked from first to last to the list of remote blocks
+	INLINE void push_remote_blcks(p_ctrl_block first, p_ctrl_block last)
+	{
+		p_ctrl_block head = m_remote.load(std::memory_order_relaxed);
 
-/////////////////////////////////////////////////////////////////////////////////////
+		do
+		{
+			last->m_prev = head;
+		}
+		while (!m_remote.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+	}
 
-BlockAllocator::~BlockAllocator()
-{
-	for (size_t i = 0; i < MaxThreadCount; i++)
+	// links the blocks freed by a thread other than the owner and adds
+	// them to the list of remote blocks at once
+	INLINE void push_remote_blcks(void** p, size_t count)
 	{
-		pool_destruct(m_ThreadPool[i]);
+		for (size_t i = 1; i < count; i++)
+			mem_to_blk(p[i - 1])->m_prev = mem_to_blk(p[i]);
+
+		m_remotes.fetch_add(count, std::memory_order_relaxed);
+
+		push_remote_blcks(mem_to_blk(p[0]), mem_to_blk(p[count - 1]));
 	}
-}
 
+	// takes a block of the size off its magazine; an empty magazine is refilled
+	// from the bins or the foot by a batch, the blocks freed by the other threads
+	// are taken back before that. A refill may bring a block a bit larger than
+	// the size, the split remainders smaller than MinSplitSize stay with it
+	INLINE void* call_magazine_malloc(size_t size)
+	{
+		p_pool_magazine magazine = &m_magazines[calc_tiny_bins_indx(size)];
+
+		if (!magazine->m_head)
+		{
+			if (m_remote.load(std::memory_order_relaxed))
+				drain_remote_blcks();
 
-/////////////////////////////////////////////////////////////////////////////////////
+			size_t used  = m_cached.load(std::memory_order_relaxed);
+			size_t room  = (used < MagazineCapacity) ? (MagazineCapacity - used) / size : 0;
+			size_t count = (room < MagazineBatch) ? room : (size_t)MagazineBatch;
 
-void* BlockAllocator::malloc(size_t size)
-{
-	void*  umem = NULL;
+			void*  p[MagazineBatch];
+			size_t done = call_pool_malloc_batch(size - m_ctrl_block::Overhead, (count > 0) ? count : 1, p);
+
+			for (size_t i = 0; i < done; i++)
+			{
+				stat_add(m_cached, size);
+				magazine->push(mem_to_blk(p[i]));
+			}
 
-	if (m_ThreadIndex == (uint16_t)(-1))
-		m_ThreadIndex = m_ThreadCount++;
+			if (!magazine->m_head)
+				return NULL;
+		}
 
-	assert(m_ThreadIndex < MaxThreadCount);
-	p_pool_local pool = m_ThreadPool[m_ThreadIndex];
+		p_ctrl_block blck = magazine->pull();
+		stat_sub(m_cached, size);
 
-	size_t indx = 0;
-	size_t bits = 0;
-	size_t flag = 0;
-	size_t mask = ((size_t)1 << MaxThreadCount) - 1;
+		return blck->user_addr();
+	}
 
-	// run through the circular list of the pools trying to lock one;
-	// the pool return 1u if it is cannot allocate the block; then try
-	// the next pool until we look over all the pools
-	do
+	// caches the small block freed by the owner in the magazine of its size;
+	// a magazine which is full, or which the capacity of all the magazines
+	// does not let grow, gives a batch of its blocks back to the bins first.
+	// The magazines of the other sizes are left alone, so a mix of sizes
+	// does not empty all of them over and over. The block may be larger than
+	// size (a remainder too small to split off stays with it), a magazine
+	// serves its blocks by its own size and counts them by it
+	INLINE void call_magazine_free(void* p, size_t size)
 	{
-		umem = pool->malloc(size);
-		pool = pool->m_next;
+		if (size < MaxTinyRequest)
+		{
+			p_pool_magazine magazine = &m_magazines[calc_tiny_bins_indx(size)];
 
-		flag = reinterpret_cast<size_t>(umem);
-		bits |= (flag << indx);
+			if (magazine->m_count >= MagazineDepth || m_cached.load(std::memory_order_relaxed) + size > MagazineCapacity)
+				trim_magazine(magazine, MagazineBatch);
 
-		flag &= ~0x1;
-		indx += 1;
-	} 
-	while ((bits ^ mask) && !flag);
+			if (m_cached.load(std::memory_order_relaxed) + size <= MagazineCapacity)
+			{
+				stat_add(m_cached, size);
+				magazine->push(mem_to_blk(p));
 
-	return CAST(flag);
-}
+				return;
+			}
+		}
 
+		call_pool_free(p);
+	}
 
-/////////////////////////////////////////////////////////////////////////////////////
+	// gives up to count blocks of the magazine back to the bins
+	INLINE void trim_magazine(p_pool_magazine magazine, size_t count)
+	{
+		size_t size = calc_tiny_bins_size(magazine - m_magazines);
 
-void BlockAllocator::free(void* umem)
-{
-	if (!umem)
-		return;
+		for (; count && magazine->m_head; count--)
+		{
+			p_ctrl_block blck = magazine->pull();
 
-	p_ctrl_block blck = mem_to_blk(umem);
-	p_pool_local pool = blck->pool();
+			stat_sub(m_cached, size);
+			call_pool_free(blck->user_addr());
+		}
+	}
 
-	if (pool)
-		pool->free(umem);
-}
+	// gives the blocks of all the magazines back to the bins
+	INLINE void flush_magazines()
+	{
+		for (size_t i = 0; m_cached.load(std::memory_order_relaxed) && i < Count; i++)
+		{
+			p_pool_magazine magazine = &m_magazines[i];
 
-/////////////////////////////////////////////////////////////////////////////////////
+			trim_magazine(magazine, magazine->m_count);
+		}
+	}
 
-p_pool_local BlockAllocator::pool_construct(size_t capacity)
-{
-	p_pool_local pool = NULL;
+	// takes the whole list of remote blocks at once and frees them
+	INLINE void drain_remote_blcks()
+	{
+		p_ctrl_block blck = m_remote.exchange(NULL, std::memory_order_acquire);
 
-	SYSTEM_INFO info;
-	GetSystemInfo(&info);
+		while (blck)
+		{
+			p_ctrl_block next = blck->m_prev;
 
-	size_t gran = info.dwAllocationGranularity;
-	size_t size = (capacity + (gran << 1) - 1) & ~(gran - 1); // align capacity to granularity size
+			stat_free(blck->size());
+			call_pool_free(blck->user_addr());
+			blck = next;
+		}
+	}
 
-	void* memory = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-	if (!memory)
-		return NULL;
+	// this routine allocates the memory block either with the alignment
+	// every block gets or with the requested larger one
+	INLINE void* call_pool_malloc(size_t bytesreq, size_t alignment)
+	{
+		if (alignment > MinAlignment)
+			return call_pool_aligned_malloc(bytesreq, alignment);
 
-	::ZeroMemory(memory, size);
+		return call_pool_malloc(bytesreq);
+	}
 
-	pool = static_cast<p_pool_local>(memory);
-	pool->init(size);
+	// this routine allocates a block large enough to hold an aligned address
+	// followed by the requested bytes; the leading slack is split off the
+	// block and freed, so it is cached in the bins or coalesced with the
+	// previous block, and then the tail is trimmed off the same way
+	void* call_pool_aligned_malloc(size_t bytesreq, size_t alignment)
+	{
+		size_t slack = alignment + m_ctrl_block::MinSize;
 
-	return pool;
-}
+		if (bytesreq > (size_t)0 - slack - 2 * m_ctrl_block::MinSize)
+			return NULL;
 
-////////////////////////////////////////////////////////////////////////////////
+		// the block left after the slack is split off holds a whole block of
+		// the requested size, whatever the overhead of a block is
+		char* mem = static_cast<char*>(call_pool_malloc(calc_blck_size(bytesreq) + slack));
+		if (mem == NULL)
+			return NULL;
 
-void BlockAllocator::pool_destruct(p_pool_local pool)
-{
-	if (pool)
-	{
-		pool->fini();
-		VirtualFree(pool, 0, MEM_RELEASE);
+		size_t addr = reinterpret_cast<size_t>(mem);
+
+		if (addr & (alignment - 1))
+		{
+			// the leading slack is large enough to make a block of its own
+			char* next = reinterpret_cast<char*>((addr + m_ctrl_block::MinSize + alignment - 1) & ~(alignment - 1));
+
+			p_ctrl_block lead = mem_to_blk(mem);
+			p_ctrl_block blck = mem_to_blk(next);
+			size_t       size = reinterpret_cast<char*>(blck) - reinterpret_cast<char*>(lead);
+
+			blck->data(CBit | PBit);
+			blck->size(lead->size() - size);
+
+			lead->size(size);
+			call_pool_free(lead->user_addr());
+
+			mem = next;
+		}
+
+		call_pool_realloc(mem, bytesreq);
+		return mem;
 	}
-}	
 
-uint16_t BlockAllocator::m_ThreadIndex = (uint16_t)-1;
+	// this routine allocates a number of blocks of the same size; the list
+	// of the cached blocks of that size is taken first, then a run of blocks
+	// is carved from the foot at once, the rest is allocated one by one
+	size_t call_pool_malloc_batch(size_t bytesreq, size_t count, void** p)
+	{
+		size_t size = calc_blck_size(bytesreq);
+		size_t done = 0;
+
+		if (size < MaxTinyRequest)
+		{
+			p_ctrl_block bins = find_tiny_bins_blck(calc_tiny_bins_indx(size));
+
+			while (done < count && bins->m_next != bins)
+			{
+				p_ctrl_block blck = bins->m_next;
+
+				pull_tiny_bins_blck(blck);
+				p[done++] = call_bins_blck_malloc(blck, size);
+			}
+		}
+
+		// the foot is carved only once the bins have nothing left which could
+		// be split, the same as for a single block
+		size_t room = m_foot->size() / size;
+		size_t todo = (count - done < room) ? count - done : room;
+
+		if (m_treebits || (size < MaxTinyRequest && (m_tinybits >> calc_tiny_bins_indx(size))))
+			todo = 0;
+
+		if (todo && commit_foot_pool(add_mem<char*>(m_foot, todo * size + FenceSize)))
+		{
+			size_t rest = m_foot->size() - todo * size;
+
+			// the foot always follows a block in use
+			for (size_t i = 0; i < todo; i++)
+			{
+				p_ctrl_block blck = m_foot;
+				blck->data(size | CBit | PBit);
+	
+				p[done++] = blck->user_addr();
+				m_foot = blck->next_blck();
+			}
+
+			m_foot->data(rest | PBit);
+
+			stat_add(m_footbytes, todo * size);
+		}
+
+		for (; done < count; done++)
+		{
+			p[done] = call_pool_malloc(bytesreq);
+
+			if (p[done] == NULL)
+				break;
+		}
+
+		return done;
+	}
+
+	// this routine tries to allocate memory block; 
+	// first it looks to the binary maps for suitable memory block
+	// (the bin of the requested size or the next larger non empty one),
+	// and later if there is enough memory is allocates a new block
+	// from the foots
+	INLINE void* call_pool_malloc(size_t bytesreq)
+	{
+		void* mem = NULL;
+
+		size_t size = calc_blck_size(bytesreq);
+
+		if ((size < MaxTinyRequest) && (m_tinybits >> calc_tiny_bins_indx(size)))
+		{
+			mem = call_tiny_bins_malloc(size);
+		}
+		else if (m_treebits)
+		{
+			mem = call_tree_bins_malloc(size);
+		}
+
+		if (mem == NULL)
+			mem = call_foot_pool_malloc(size);
+				
+		return mem;
+	}
+
+	// this routine resizes the block in place: it is grown into the next block
+	// if that one is free or is the foot, and the tail of the block is split
+	// off and freed unless it is smaller than MinSplitSize; returns false if
+	// the next block cannot make up for the growth
+	bool call_pool_realloc(void* p, size_t bytesreq)
+	{
+		p_ctrl_block curr_b = mem_to_blk(p);
+		size_t       curr_s = curr_b->size();
+
+		size_t size = calc_blck_size(bytesreq);
+
+		assert(m_map->find(curr_b) == this);
+
+		if (size > curr_s)
+		{
+			p_ctrl_block next_b = curr_b->next_blck();
+			size_t       next_s = next_b->size();
+
+			if (next_b->cbit() || curr_s + next_s < size)
+				return false;
+
+			// the foot gives up the missing bytes only, the
+			// tail is never split off back to it
+			if (next_b == m_foot)
+			{
+				if (!commit_foot_pool(add_mem<char*>(curr_b, size + FenceSize)))
+					return false;
+
+				curr_b->size(size);
+
+				m_foot = curr_b->next_blck();
+				m_foot->size(curr_s + next_s - size);
+				m_foot->turn(PBit);
+				m_foot->drop(CBit);
+
+				stat_add(m_footbytes, size - curr_s);
+
+				return true;
+			}
+
+			if (next_s < MaxTinyRequest)
+			{
+				pull_tiny_bins_blck(next_b);
+			}
+			else
+			{
+				// the tail split off below is freed as a block which was
+				// in use, so the whole of the next block has to be committed
+				if (!commit_tree_bins_blck(next_b, reinterpret_cast<char*>(next_b->next_blck())))
+					return false;
+
+				pull_tree_bins_blck(next_b);
+			}
+
+			curr_s += next_s;
+
+			curr_b->size(curr_s);
+			curr_b->next_blck()->turn(PBit);
+		}
+
+		size_t rest = curr_s - size;
+
+		// the tail is freed as an allocated block, so that
+		// it is coalesced with the next one if that is free
+		if (rest >= MinSplitSize)
+		{
+			curr_b->size(size);
+
+			p_ctrl_block tail = curr_b->next_blck();
+			tail->data(CBit | PBit);
+			tail->size(rest);
+
+			call_pool_free(tail->user_addr());
+		}
+
+		return true;
+	}
+
+	// this routine releases allocated memory block; it tries to coalesce
+	// it with the previous or the next block, and then caches the result
+	// in the binary map
+	void call_pool_free(void* p)
+	{
+		p_ctrl_block curr_b = mem_to_blk(p);
+		size_t       curr_s = curr_b->size();
+		size_t       trim   = 0;
+
+		assert(m_map->find(curr_b) == this);
+
+		if (!curr_b->cbit())
+			return;
+
+		p_ctrl_block next_b = curr_b->next_blck();
+		size_t       next_s = next_b->size();
+
+		if (!curr_b->pbit()) //coalesce with previous block
+		{
+			size_t       prev_s = curr_b->head();
+			p_ctrl_block prev_b = curr_b->prev_blck();
+
+			if (prev_s < MaxTinyRequest)
+			{
+				pull_tiny_bins_blck(prev_b);
+			}
+			else
+			{
+				trim |= prev_b->m_trim;
+				pull_tree_bins_blck(prev_b);
+			}
+
+			curr_b = prev_b;
+			curr_s += prev_s;
+
+			stat_add(m_coalesced, 1);
+		}
+
+		if (!next_b->cbit()) //coalesce with next block
+		{
+			curr_s += next_s;
+
+			stat_add(m_coalesced, 1);
+
+			if (next_b == m_foot)
+			{
+				assert(!trim);
+
+				m_foot = curr_b;
+				m_foot->size(curr_s);
+				m_foot->turn(PBit);
+				m_foot->drop(CBit);
+
+				trim_foot_pool(TrimSize);
+				return;
+			}
+			
+
+			if (next_s < MaxTinyRequest)
+			{
+				pull_tiny_bins_blck(next_b);
+			}
+			else
+			{
+				trim |= next_b->m_trim;
+				pull_tree_bins_blck(next_b);
+			}
+			
+		}
+						
+		curr_b->drop(CBit);
+		curr_b->size(curr_s);
+		curr_b->next_blck()->drop(PBit);
+		curr_b->next_blck()->head(curr_s);
+
+		if (curr_s < MaxTinyRequest)
+		{
+			push_tiny_bins_blck(curr_b);
+		}
+		else
+		{
+			curr_b->m_trim = trim;
+			push_tree_bins_blck(curr_b);
+
+			trim_tree_bins_blck(curr_b, TrimSize);
+		}
+	}
+
+	// the size of the block holding the requested number of bytes
+	INLINE static size_t calc_blck_size(size_t bytesreq)
+	{
+		size_t size = (bytesreq + m_ctrl_block::Overhead + MinAlignment - 1) & ~(size_t)(MinAlignment - 1); //adjusting the size to the alignment of the blocks
+
+		return (size < m_ctrl_block::MinSize) ? (size_t)m_ctrl_block::MinSize : size;
+	}
+
+	INLINE p_ctrl_block find_tiny_bins_blck(size_t indx)
+	{
+		assert(indx < Count);
+		return &m_tinybins[indx];
+	}
+
+	INLINE p_ctrl_block find_tree_bins_blck(size_t indx)
+	{
+		assert(indx < Count);
+		return m_treebins[indx];
+	}
+
+	// the index in the array of linked lists; 
+	// map size value to the array of 32 bins;
+	INLINE static size_t calc_tiny_bins_indx(size_t size)
+	{
+		return size >> 3;
+	}	
+
+	INLINE static size_t calc_tiny_bins_size(size_t indx)
+	{
+		return indx << 3;
+	}
+
+	// the index in the array of trees is the most 
+	// significant bit of the size
+	INLINE static size_t calc_tree_bins_indx(size_t size)
+	{
+		unsigned long indx;
+		BSR(&indx, size);
+
+		assert(indx < Count);
+		return indx;
+	}
+
+	// takes the first block in the linked list of the requested size,
+	// or in the next larger non empty one
+	INLINE void* call_tiny_bins_malloc(size_t size)
+	{
+		size_t bits = m_tinybits & ~(((size_t)1 << calc_tiny_bins_indx(size)) - 1);
+
+		unsigned long indx;
+		BSF(&indx, bits);
+
+		assert((find_tiny_bins_blck(indx)->m_next != find_tiny_bins_blck(indx)) && (find_tiny_bins_blck(indx)->m_prev != find_tiny_bins_blck(indx)));
+
+		p_ctrl_block blck = find_tiny_bins_blck(indx)->m_next;
+
+		pull_tiny_bins_blck(blck);
+		return call_bins_blck_malloc(blck, size);
+	}
+		
+	// tries to find the most suitable memory block in the
+	// binary trees: the smallest one which is not smaller than
+	// the requested size; the tree of the requested size is
+	// looked through first, then the next larger non empty one
+	INLINE void* call_tree_bins_malloc(size_t size)
+	{
+		size_t indx = calc_tree_bins_indx(size);
+
+		p_ctrl_block topt = NULL;
+		p_ctrl_block blck = NULL;
+		p_ctrl_block rest = NULL; // the deepest right subtree not taken on the way down
+
+		size_t rsize = (size_t)0 - size; // blocks smaller than the request never fit
+
+		size_t H = sizeof(size_t) * 8 - 1;
+		size_t R = size << (H - indx);
+
+		// walk down along the path of the requested size
+		for (topt = ((m_treebits >> indx) & 1u) ? find_tree_bins_blck(indx) : NULL; topt; )
+		{
+			size_t srem = topt->size() - size;
+			if (srem < rsize)
+			{
+				rsize = srem;
+				blck = topt;
+
+				if (rsize == 0)
+					break;
+			}
+
+			R <<= 1;
+
+			p_ctrl_block rght = topt->m_limb[1];
+			topt = topt->m_limb[(R >> H) & 1u];
+
+			if (rght && rght != topt)
+				rest = rght;
+
+			if (!topt)
+			{
+				topt = rest; // holds the sizes next to the requested one
+				break;
+			}
+		}
+
+		// nothing fits in the tree of the requested size,
+		// take the least non empty tree above it
+		if (!blck && !topt)
+		{
+			size_t bits = m_treebits & ~(((size_t)2 << indx) - 1);
+
+			unsigned long next;
+			if (BSF(&next, bits))
+				topt = find_tree_bins_blck(next);
+		}
+
+		// the smallest block of the subtree is on its left most path
+		while (rsize && topt)
+		{
+			size_t srem = topt->size() - size;
+			if (srem < rsize)
+			{
+				rsize = srem;
+				blck = topt;
+			}
+
+			topt = topt->left_most_limb();
+		}
+
+		if (!blck)
+			return NULL;
+
+		// either the tail split off is a tree block and only its header is
+		// touched, or the whole block is within the size of a tree block more
+		if (!commit_tree_bins_blck(blck, add_mem<char*>(blck, size + ((MinSplitSize > MaxTinyRequest) ? MinSplitSize : MaxTinyRequest))))
+			return NULL;
+
+		pull_tree_bins_blck(blck);
+		return call_bins_blck_malloc(blck, size);
+	}
+
+	// hands out the memory block which has just been pulled out of the bins;
+	// the tail of the block is split off and cached again unless it is smaller
+	// than MinSplitSize, in which case it stays with the allocated block
+	INLINE void* call_bins_blck_malloc(p_ctrl_block blck, size_t size)
+	{
+		size_t rest = blck->size() - size;
+
+		if (rest >= MinSplitSize)
+		{
+			size_t trim = (rest >= MaxTinyRequest) ? blck->m_trim : 0; // the tail may overlay the header
+
+			blck->size(size);
+
+			p_ctrl_block tail = blck->next_blck();
+			tail->data(PBit);
+			tail->size(rest);
+			tail->next_blck()->head(rest);
+
+			if (rest < MaxTinyRequest)
+			{
+				push_tiny_bins_blck(tail);
+			}
+			else
+			{
+				tail->m_trim = trim;
+				push_tree_bins_blck(tail);
+			}
+		}
+		else
+		{
+			blck->next_blck()->turn(PBit);
+		}
+
+		blck->turn(CBit);
+
+		return blck->user_addr();
+	}
+
+	// allocates a new memory block on the foot; the foot is moved to a new
+	// segment if the current one is exhausted, and the memory under the new
+	// block is committed as the foot advances
+	INLINE void* call_foot_pool_malloc(size_t size)
+	{
+		if ((size > m_foot->size()) && !grow_foot_pool(size))
+			return NULL;
+
+		if (!commit_foot_pool(add_mem<char*>(m_foot, size + FenceSize)))
+			return NULL;
+
+		size_t rest = m_foot->size() - size;
+
+		p_ctrl_block blck = m_foot;
+		blck->size(size);
+		blck->turn(CBit);
+
+		m_foot = blck->next_blck();
+		m_foot->size(rest);
+		m_foot->turn(PBit);
+		m_foot->drop(CBit);
+
+		stat_add(m_footbytes, size);
+
+		return blck->user_addr();
+	}	
+
+	// the end of the range to commit in the segment of the foot in order to
+	// make the specified address accessible
+	INLINE char* calc_foot_pool_tail(char* addr)
+	{
+		char* tail = reinterpret_cast<char*>((reinterpret_cast<size_t>(addr) + CommitSize - 1) & ~(size_t)(CommitSize - 1));
+		char* last = m_segments->end();
+
+		return (tail < last) ? tail : last;
+	}
+
+	// commits the memory of the segment of the foot up to the specified address
+	INLINE bool commit_foot_pool(char* addr)
+	{
+		if (addr <= m_tail)
+			return true;
+
+		char* tail = calc_foot_pool_tail(addr);
+		if (!page_commit(m_tail, tail - m_tail))
+			return false;
+
+		m_tail = tail;
+		return true;
+	}
+
+	// gives the committed memory above the foot back to the OS,
+	// once there is more than the specified amount of it
+	INLINE void trim_foot_pool(size_t limit)
+	{
+		char* tail = calc_foot_pool_tail(add_mem<char*>(m_foot, FenceSize + CommitSize));
+
+		if (m_tail > tail && static_cast<size_t>(m_tail - tail) >= limit)
+		{
+			page_decommit(tail, m_tail - tail);
+			m_tail = tail;
+		}
+	}
+
+	// the range of the pages of a free tree block which may be decommitted:
+	// the header of the block and the one of the next block are kept
+	INLINE static void calc_tree_bins_pages(p_ctrl_block blck, char** head, char** tail)
+	{
+		*head = reinterpret_cast<char*>((reinterpret_cast<size_t>(blck) + sizeof(m_ctrl_block) + CommitSize - 1) & ~(size_t)(CommitSize - 1));
+		*tail = reinterpret_cast<char*>(reinterpret_cast<size_t>(blck->next_blck()) & ~(size_t)(CommitSize - 1));
+	}
+
+	// gives the pages of a free tree block back to the OS, once there are more
+	// than the specified amount of them; only the blocks of the segments chained
+	// before the segment of the foot are trimmed, these are never coalesced with
+	// the foot, which expects the memory below m_tail to be committed
+	INLINE void trim_tree_bins_blck(p_ctrl_block blck, size_t limit)
+	{
+		char* addr = reinterpret_cast<char*>(blck);
+		if (addr >= m_segments->m_addr && addr < m_segments->end())
+			return;
+
+		char* head;
+		char* tail;
+		calc_tree_bins_pages(blck, &head, &tail);
+
+		if (tail > head && static_cast<size_t>(tail - head) >= limit)
+		{
+			page_decommit(head, tail - head);
+			blck->m_trim = 1;
+		}
+	}
+
+	// commits the pages of a free tree block up to the specified address
+	// before the block is handed out, if the block has been trimmed
+	INLINE bool commit_tree_bins_blck(p_ctrl_block blck, char* addr)
+	{
+		if (!blck->m_trim)
+			return true;
+
+		char* head;
+		char* tail;
+		calc_tree_bins_pages(blck, &head, &tail);
+
+		char* last = reinterpret_cast<char*>((reinterpret_cast<size_t>(addr) + CommitSize - 1) & ~(size_t)(CommitSize - 1));
+		if (last < tail)
+			tail = last;
+
+		return (tail <= head) || page_commit(head, tail - head);
+	}
+
+	// chains a new segment large enough to hold a block of the specified size
+	// and moves the foot to it; the end of the previous segment is sealed by a
+	// fence block, so that blocks are never coalesced across segments, and the
+	// rest of the previous foot is cached in the bins
+	bool grow_foot_pool(size_t size)
+	{
+		size_t span = sizeof(m_pool_segment) + size + FenceSize;
+
+		if (span < m_segment.m_size)
+			span = m_segment.m_size;
+
+		span = (span + m_page_map::GrainSize - 1) & ~(size_t)(m_page_map::GrainSize - 1);
+
+		char* memory = static_cast<char*>(page_reserve_aligned(span, m_page_map::GrainSize));
+		if (!memory)
+			return false;
+
+		size_t head = (sizeof(m_pool_segment) + FenceSize + CommitSize - 1) & ~(size_t)(CommitSize - 1);
+		if (head > span)
+			head = span;
+
+		if (!page_commit(memory, head) || !m_map->insert(memory, span, this))
+		{
+			m_map->erase(memory, span);
+			page_free(memory, span);
+			return false;
+		}
+
+		// seal the segment of the current foot; the fence is placed at the
+		// end of the committed memory and carries the in use flag
+		p_ctrl_block fence = sub_mem<p_ctrl_block>(m_tail, FenceSize);
+		size_t       rest  = reinterpret_cast<char*>(fence) - reinterpret_cast<char*>(m_foot);
+
+		if (rest < m_ctrl_block::MinSize)
+		{
+			fence = m_foot;
+			fence->data(CBit | PBit);
+		}
+		else
+		{
+			fence->data(CBit);
+			fence->head(rest);
+
+			m_foot->size(rest);
+
+			if (rest < MaxTinyRequest)
+			{
+				push_tiny_bins_blck(m_foot);
+			}
+			else
+			{
+				m_foot->m_trim = 0;
+				push_tree_bins_blck(m_foot);
+			}
+		}
+
+		p_pool_segment segment = reinterpret_cast<p_pool_segment>(memory);
+
+		segment->m_addr = memory;
+		segment->m_size = span;
+		segment->m_blck = add_mem<p_ctrl_block>(memory, sizeof(m_pool_segment));
+		segment->m_next = m_segments;
+
+		m_segments = segment;
+		m_tail = memory + head;
+
+		stat_add(m_segcount, 1);
+		stat_add(m_segbytes, span);
+
+		m_foot = segment->m_blck;
+		m_foot->size(span - sizeof(m_pool_segment) - FenceSize);
+		m_foot->turn(PBit);
+
+		return true;
+	}
+
+	// add memory block to the specified linked list
+	INLINE void push_tiny_bins_blck(p_ctrl_block blck)
+	{
+		size_t size = blck->size();
+		size_t indx = calc_tiny_bins_indx(size);
+
+		assert(indx < Count);
+
+		p_ctrl_block prev = find_tiny_bins_blck(indx);
+		p_ctrl_block next = prev->m_next;
+
+		prev->m_next = blck;
+		next->m_prev = blck;
+		blck->m_next = next;
+		blck->m_prev = prev;
+
+		m_tinybits |= ((size_t)1 << indx);
+
+		stat_add(m_tinybytes, size);
+	}
+
+	// add memory block to the tree
+	INLINE void push_tree_bins_blck(p_ctrl_block blck)
+	{
+		size_t size = blck->size();
+		size_t indx = calc_tree_bins_indx(size);
+
+		stat_add(m_treebytes, size);
+
+		blck->indx(indx);
+
+		blck->m_limb[0] = NULL;
+		blck->m_limb[1] = NULL;
+
+		size_t mask = (size_t)1u << indx;
+		if ((m_treebits & mask) == 0)
+		{
+			m_treebits |= mask;
+			m_treebins[indx] = blck;
+
+			blck->m_parent = m_treebins[indx];
+
+			blck->m_next = blck;
+			blck->m_prev = blck;
+
+			return;
+		}
+
+		p_ctrl_block topt = find_tree_bins_blck(indx);
+
+		// the bits of the size below the most significant one select the
+		// path in the tree, starting from the highest
+		size_t H = sizeof(size_t) * 8 - 1;
+		size_t R = size << (H - indx);
+
+		for (;;)
+		{
+			R <<= 1;
+
+			if (topt->size() != size)
+			{
+				p_ctrl_block* c = &topt->m_limb[(R >> H) & 1u];
+
+				if (*c)
+				{
+					topt = *c;
+				}
+				else
+				{
+					*c = blck;
+
+					blck->m_parent = topt;
+
+					blck->m_next = blck;
+					blck->m_prev = blck;
+
+					break;
+				}
+			}
+			else
+			{
+				p_ctrl_block next = topt->m_next;
+
+				topt->m_next = blck;
+				next->m_prev = blck;
+
+				blck->m_next = next;
+				blck->m_prev = topt;
+
+				blck->m_parent = NULL;
+				break;
+			}
+		}
+	}
+
+	// remove memory block from the specified linked list
+	INLINE void pull_tiny_bins_blck(p_ctrl_block blck)
+	{
+		p_ctrl_block lblk = static_cast<p_ctrl_block>(blck);
+
+		size_t size = lblk->size();
+		size_t indx = calc_tiny_bins_indx(size);
+
+		assert(indx < Count);
+
+		p_ctrl_block next = blck->m_next;
+		p_ctrl_block prev = blck->m_prev;
+
+		if (next == prev) // drop bits
+			m_tinybits &= ~((size_t)1 << indx);
+
+		next->m_prev = prev;
+		prev->m_next = next;
+
+		stat_sub(m_tinybytes, size);
+	}
+
+	// remove memory block from the tree
+	INLINE void pull_tree_bins_blck(p_ctrl_block blck)
+	{
+		stat_sub(m_treebytes, blck->size());
+
+		p_ctrl_block prnt = blck->m_parent;
+		p_ctrl_block temp = NULL;
+
+		if (blck->m_prev != blck)
+		{
+			p_ctrl_block next = blck->m_next;
+			p_ctrl_block prev = blck->m_prev;
+
+			next->m_prev = prev;
+			prev->m_next = next;
+
+			temp = prev;
+		}
+		else
+		{
+			p_ctrl_block* up;
+			if ((temp = *(up = &(blck->m_limb[1]))) || (temp = *(up = &(blck->m_limb[0]))))
+			{
+				p_ctrl_block* vp;
+				while (*(vp = &(temp->m_limb[1])) || *(vp = &(temp->m_limb[0])))
+				{
+					temp = *(up = vp);
+				}
+
+				*up = 0;
+			}								
+		}
+
+		if (prnt)
+		{
+			size_t indx = blck->indx();
+			p_ctrl_block* t = &m_treebins[indx];
+
+			if (blck == *t)
+			{
+				if ((*t = temp) == 0)
+				{
+					m_treebits &= ~((size_t)1u << indx);
+				}
+			}
+			else
+			{
+				if (prnt->m_limb[0] == blck)
+				{
+					prnt->m_limb[0] = temp;
+				}
+				else
+				{
+					prnt->m_limb[1] = temp;
+				}
+			}
+
+			if (temp)
+			{
+				p_ctrl_block cld0, cld1;
+				temp->m_parent = prnt;
+
+				if ((cld0 = blck->m_limb[0]))
+				{
+					temp->m_limb[0] = cld0;
+					cld0->m_parent  = temp;
+				}
+				if ((cld1 = blck->m_limb[1]))
+				{
+					temp->m_limb[1] = cld1;
+					cld1->m_parent  = temp;
+				}
+			}
+		}
+	}
+
+	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_pool_local);
+};
+
+
+//===================================================================================
+//
+// thread bindings:
+
+namespace
+{
+	// This is a thread local cache of entries keyed by allocator id; it is set
+	// associative, an id is kept in the ways of the set it maps to, the most
+	// recently used first, so that a few allocators mapping to the same set do
+	// not evict each other. The entries are zero filled, id 0 is never used
+	template <typename Entry, size_t Sets, size_t Ways>
+	struct CacheSets
+	{
+		Entry m_entries[Sets][Ways];
+
+		// returns the entry of the id, moved to the front of its set; NULL
+		// if the id is not cached
+		INLINE Entry* find(size_t id)
+		{
+			Entry* set = m_entries[id % Sets];
+
+			if (set[0].m_id == id)
+				return &set[0];
+
+			for (size_t i = 1; i < Ways; i++)
+			{
+				if (set[i].m_id == id)
+				{
+					Entry hit = set[i];
+
+					for (; i > 0; i--)
+						set[i] = set[i - 1];
+
+					set[0] = hit;
+					return &set[0];
+				}
+			}
+
+			return NULL;
+		}
+
+		// returns a blank entry of the id at the front of its set, the least
+		// recently used entry of the set is evicted
+		INLINE Entry* insert(size_t id)
+		{
+			Entry* set = m_entries[id % Sets];
+
+			for (size_t i = Ways - 1; i > 0; i--)
+				set[i] = set[i - 1];
+
+			set[0] = Entry();
+			set[0].m_id = id;
+
+			return &set[0];
+		}
+
+		INLINE void clear()
+		{
+			for (size_t i = 0; i < Sets; i++)
+				for (size_t j = 0; j < Ways; j++)
+					m_entries[i][j].m_id = 0;
+		}
+	};
+
+	// the binding of the thread to a pool of an allocator; an evicted binding
+	// stays in effect, it is only looked up the slow way
+	struct PoolEntry
+	{
+		size_t       m_id;
+		p_pool_local m_pool;     // NULL when the thread could not be bound to a pool
+		p_pool_local m_fallback; // the pool the last fallback allocation came from
+		size_t       m_strikes;  // fallback allocations served by that pool in a row
+	};
+
+	using ThreadCache = CacheSets<PoolEntry, 8, 4>;
+
+	THREAD_LOCAL(ThreadCache) g_ThreadCache;
+
+	ATOMIC_VALUE(size_t) g_AllocatorIds(0); // ids are never reused, so a stale cache entry never matches
+
+	// the bytes the thread allocates from an allocator before its next sample;
+	// an evicted count is drawn anew, the distances are memoryless
+	struct SampleEntry
+	{
+		size_t m_id;
+		size_t m_bytes;
+	};
+
+	using SampleCache = CacheSets<SampleEntry, 4, 4>;
+
+	THREAD_LOCAL(SampleCache) g_SampleCache;
+	THREAD_LOCAL(uint64_t)    g_SampleSeed; // state of the generator of the distances between the samples
+
+	LOCK            g_AllocatorsLock;
+	BlockAllocator* g_Allocators = NULL; // list of the live allocators, guarded by g_AllocatorsLock
+}
+
+// This object lives in thread local storage of every thread bound to a pool;
+// it hands the pools of the thread over to other threads on thread exit.
+struct BlockAllocator::ThreadGuard
+{
+	~ThreadGuard()
+	{
+		const void* token = thread_token();
+
+		SCOPE_LOCK(g_AllocatorsLock);
+
+		for (BlockAllocator* allocator = g_Allocators; allocator; allocator = allocator->m_NextAllocator)
+		{
+			allocator->pool_release(token);
+		}
+
+		g_ThreadCache.clear();
+	}
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// returns the pool of this allocator the calling thread is bound to
+INLINE p_pool_local BlockAllocator::pool_local()
+{
+	PoolEntry* entry = g_ThreadCache.find(m_AllocatorId);
+
+	if (entry)
+		return entry->m_pool;
+
+	return pool_bind();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// returns the pool owning the user memory, or NULL if the memory
+// does not belong to the allocator
+INLINE p_pool_local BlockAllocator::pool_lookup(void* umem)
+{
+	if (!m_PageMap)
+		return NULL;
+
+	return m_PageMap->find(umem);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// binds the calling thread to a pool of this allocator: to the pool the thread
+// already owns, to a pool left by an exited thread or to a new one
+p_pool_local BlockAllocator::pool_bind()
+{
+	// the guard is constructed when the thread gets here for the first time
+	THREAD_LOCAL(ThreadGuard) guard;
+
+	const void*  token = thread_token();
+	p_pool_local pool  = NULL;
+
+	while (!pool)
+	{
+		p_pool_local spare = NULL;
+		size_t       count = m_ThreadCount.load(std::memory_order_acquire);
+
+		for (size_t i = 0; i < count && !pool; i++)
+		{
+			p_pool_local next = pool_find(i);
+			if (!next)
+				continue;
+
+			const void* owner = next->m_owner.load(std::memory_order_relaxed);
+
+			if (owner == token)
+			{
+				pool = next;
+			}
+			else if (!owner && !spare)
+			{
+				spare = next;
+			}
+		}
+
+		if (!pool && spare && spare->claim(token))
+			pool = spare;
+
+		if (!pool && !spare)
+		{
+			pool = pool_create(token);
+			if (!pool)
+				break;
+		}
+	}
+
+	// a thread which could not be bound keeps falling back to the other
+	// pools, until it moves to one of them (see pool_fallback)
+
+	g_ThreadCache.insert(m_AllocatorId)->m_pool = pool;
+
+	return pool;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// hands the pools owned by the exiting thread over to the other threads
+void BlockAllocator::pool_release(const void* token)
+{
+	size_t count = m_ThreadCount.load(std::memory_order_acquire);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		p_pool_local pool = pool_find(i);
+
+		if (pool && pool->m_owner.load(std::memory_order_relaxed) == token)
+			pool->release();
+	}
+}
+
+
+//===================================================================================
+//
+//
+
+BlockAllocator::BlockAllocator(size_t thread_local_capacity)
+	: m_Capacity(thread_local_capacity ? thread_local_capacity : (size_t)DefaultCapacity)
+	, m_AllocatorId(++g_AllocatorIds)
+	, m_ThreadCount(0)
+	, m_Fallbacks(0)
+	, m_FallbackBusy(0)
+	, m_Migrations(0)
+	, m_HugeBlocks(0)
+	, m_HugeBytes(0)
+	, m_Profile(NULL)
+	, m_SampleRate(0)
+	, m_Trace(NULL)
+	, m_Tracing(false)
+{
+	for (size_t i = 0; i < DirectorySize; i++)
+	{
+		m_ThreadPool[i] = NULL;
+	}
+
+	// fresh pages are zero filled, that is an empty map
+	m_PageMap = static_cast<p_page_map>(page_alloc(sizeof(m_page_map)));
+
+	SCOPE_LOCK(g_AllocatorsLock);
+
+	m_NextAllocator = g_Allocators;
+	g_Allocators = this;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+BlockAllocator::~BlockAllocator()
+{
+	{
+		SCOPE_LOCK(g_AllocatorsLock);
+
+		BlockAllocator** link = &g_Allocators;
+		while (*link != this)
+			link = &(*link)->m_NextAllocator;
+
+		*link = m_NextAllocator;
+	}
+
+	for (size_t i = 0; i < DirectorySize; i++)
+	{
+		p_pool_chunk chunk = m_ThreadPool[i];
+		if (!chunk)
+			continue;
+
+		for (size_t j = 0; j < DirectoryChunk; j++)
+		{
+			pool_destruct(chunk[j]);
+		}
+
+		page_free(chunk, sizeof(chunk[0]) * DirectoryChunk);
+	}
+
+	if (m_PageMap)
+	{
+		m_PageMap->fini();
+		page_free(m_PageMap, sizeof(m_page_map));
+	}
+
+	m_heap_profile::destroy(m_Profile.load(std::memory_order_relaxed));
+	m_trace_recorder::destroy(m_Trace.load(std::memory_order_relaxed));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// allocates from the own pool first, then from the pools of the other
+// threads; alignments up to the one every block gets are ignored. A request
+// aligned so that it takes a huge block's worth of memory with its slack is
+// served by a huge block, which is aligned without slack; a pool would leave
+// the slack in its bins, and could not bin it once it outgrows the trees
+INLINE void* BlockAllocator::pool_malloc(size_t size, size_t alignment)
+{
+	if (size >= m_huge_block::Threshold)
+		return huge_malloc(size, alignment);
+
+	if (alignment > m_pool_local::MinAlignment && alignment >= m_huge_block::Threshold - size)
+		return huge_malloc(size, alignment);
+
+	// the owner allocates from its pool without locking it
+	p_pool_local pool = pool_local();
+
+	if (pool)
+	{
+		void* umem = pool->local_malloc(size, alignment);
+		if (umem)
+			return umem;
+	}
+
+	return pool_fallback(pool, size, alignment);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// allocates from the pools nobody owns when the own pool of the thread is out
+// of memory or the thread has none. The pool which served the thread the last
+// time is tried first, so the blocks of the thread stay together; then the
+// pools are run through starting after the own one. A pool returns 1u if it
+// cannot allocate the block (or it is owned by another thread) and 0u if it is
+// locked; the pools are run through again, backing off, while some of them were
+// locked. A thread served by the same pool MigrateStrikes times in a row moves
+// to it: it claims that pool and hands its own one over to the other threads
+void* BlockAllocator::pool_fallback(p_pool_local home, size_t size, size_t alignment)
+{
+	// the entry was looked up (or made) by pool_local just before
+	PoolEntry*   entry = g_ThreadCache.find(m_AllocatorId);
+	p_pool_local last  = entry ? entry->m_fallback : NULL;
+	p_pool_local pool  = NULL;
+	void*        umem = NULL;
+	size_t       busy = 0;
+
+	if (last)
+	{
+		umem = last->malloc(size, alignment);
+
+		if (umem == VOID_0)
+		{
+			busy += 1;
+		}
+		else if (umem != VOID_1)
+		{
+			pool = last;
+		}
+	}
+
+	size_t indx  = home ? home->m_indx : 0;
+	size_t count = m_ThreadCount.load(std::memory_order_acquire);
+
+	if (count > MaxThreadCount)
+		count = MaxThreadCount;
+
+	for (uint32_t backoff = 1; !pool; )
+	{
+		size_t locked = 0;
+
+		for (size_t i = 1; i <= count && !pool; i++)
+		{
+			p_pool_local next = pool_find((indx + i) % count);
+			if (!next)
+				continue;
+
+			umem = next->malloc(size, alignment);
+
+			if (umem == VOID_0)
+			{
+				locked += 1;
+			}
+			else if (umem != VOID_1)
+			{
+				pool = next;
+			}
+		}
+
+		busy += locked;
+
+		if (!pool && !locked)
+			break;
+
+		for (uint32_t i = 0; !pool && i < backoff; i++)
+			CPU_PAUSE();
+
+		if (backoff < SpinLock::MaxBackoff)
+			backoff <<= 1;
+	}
+
+	if (busy)
+		m_FallbackBusy.fetch_add(busy, std::memory_order_relaxed);
+
+	if (!pool)
+		return NULL;
+
+	m_Fallbacks.fetch_add(1, std::memory_order_relaxed);
+
+	if (!entry)
+		return umem;
+
+	if (pool != last)
+	{
+		entry->m_fallback = pool;
+		entry->m_strikes = 1;
+	}
+	else if (++entry->m_strikes >= MigrateStrikes && pool->claim(thread_token()))
+	{
+		if (home)
+			home->release();
+
+		entry->m_pool = pool;
+		entry->m_fallback = NULL;
+		entry->m_strikes = 0;
+
+		m_Migrations.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	return umem;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+BlockAllocator::FallbackStats BlockAllocator::fallback_stats() const
+{
+	FallbackStats stats;
+
+	stats.m_Fallbacks  = m_Fallbacks.load(std::memory_order_relaxed);
+	stats.m_Busy       = m_FallbackBusy.load(std::memory_order_relaxed);
+	stats.m_Migrations = m_Migrations.load(std::memory_order_relaxed);
+
+	return stats;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// sums the counters of the pools up; the counters are read while the pools
+// run, so the snapshot is consistent only roughly, but it takes no lock
+BlockAllocator::Stats BlockAllocator::stats() const
+{
+	Stats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	static_assert(Stats::BinCount == 2 * m_pool_local::Count, "the bins of the statistics are the ones of the pools");
+
+	size_t count = m_ThreadCount.load(std::memory_order_acquire);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		p_pool_local pool = pool_find(i);
+		if (!pool)
+			continue;
+
+		stats.m_Pools += 1;
+
+		if (pool->m_owner.load(std::memory_order_relaxed))
+			stats.m_OwnedPools += 1;
+
+		stats.m_Segments += pool->m_segcount.load(std::memory_order_relaxed);
+		stats.m_Reserved += pool->m_segbytes.load(std::memory_order_relaxed);
+
+		for (size_t j = 0; j < Stats::BinCount; j++)
+		{
+			stats.m_Mallocs[j] += pool->m_mallocs[j].load(std::memory_order_relaxed);
+			stats.m_Frees[j]   += pool->m_frees[j].load(std::memory_order_relaxed);
+		}
+
+		stats.m_FootBytes      += pool->m_footbytes.load(std::memory_order_relaxed);
+		stats.m_Coalesced      += pool->m_coalesced.load(std::memory_order_relaxed);
+		stats.m_ForeignMallocs += pool->m_foreign.load(std::memory_order_relaxed);
+		stats.m_RemoteFrees    += pool->m_remotes.load(std::memory_order_relaxed);
+		stats.m_LockFailures   += pool->m_lockfails.load(std::memory_order_relaxed);
+
+		stats.m_TinyBytes     += pool->m_tinybytes.load(std::memory_order_relaxed);
+		stats.m_TreeBytes     += pool->m_treebytes.load(std::memory_order_relaxed);
+		stats.m_MagazineBytes += pool->m_cached.load(std::memory_order_relaxed);
+	}
+
+	stats.m_HugeBlocks = m_HugeBlocks.load(std::memory_order_relaxed);
+	stats.m_HugeBytes  = m_HugeBytes.load(std::memory_order_relaxed);
+
+	stats.m_Fallback = fallback_stats();
+
+	return stats;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// walks the pool unless another thread owns it; a pool nobody owns is locked
+// meanwhile, which keeps it from being claimed or allocated from, while the
+// owner of a pool never locks it. walked tells whether the pool was walked;
+// returns false if the routine stopped the walk
+bool BlockAllocator::pool_walk(p_pool_local pool, WalkCallback callback, void* context, bool& walked)
+{
+	const void* token = thread_token();
+
+	walked = false;
+
+	if (pool->m_owner.load(std::memory_order_relaxed) == token)
+	{
+		walked = true;
+		return pool->walk(callback, context);
+	}
+
+	SCOPE_LOCK(pool->m_lock);
+
+	if (pool->m_owner.load(std::memory_order_relaxed))
+		return true;
+
+	walked = true;
+	return pool->walk(callback, context);
+}
+
+bool BlockAllocator::walk(WalkCallback callback, void* context)
+{
+	size_t count = m_ThreadCount.load(std::memory_order_acquire);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		p_pool_local pool = pool_find(i);
+		if (!pool)
+			continue;
+
+		bool walked;
+
+		if (!pool_walk(pool, callback, context, walked))
+			return false;
+	}
+
+	return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// this routine accounts a block to the report
+static bool fragmentation_block(const BlockAllocator::BlockInfo& info, void* context)
+{
+	BlockAllocator::FragmentationReport* report = static_cast<BlockAllocator::FragmentationReport*>(context);
+
+	if (info.m_Foot)
+	{
+		report->m_FootBytes += info.m_Size;
+
+		if (report->m_LargestFoot < info.m_Size)
+			report->m_LargestFoot = info.m_Size;
+	}
+	else if (info.m_Used)
+	{
+		report->m_UsedBlocks += 1;
+		report->m_UsedBytes  += info.m_Size;
+	}
+	else
+	{
+		report->m_FreeBlocks += 1;
+		report->m_FreeBytes  += info.m_Size;
+
+		report->m_FreeBins[m_pool_local::calc_stat_bins_indx(info.m_Size)] += info.m_Size;
+
+		if (report->m_LargestFree < info.m_Size)
+			report->m_LargestFree = info.m_Size;
+	}
+
+	return true;
+}
+
+BlockAllocator::FragmentationReport BlockAllocator::fragmentation()
+{
+	FragmentationReport report;
+	memset(&report, 0, sizeof(report));
+
+	size_t count = m_ThreadCount.load(std::memory_order_acquire);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		p_pool_local pool = pool_find(i);
+		if (!pool)
+			continue;
+
+		bool walked;
+		pool_walk(pool, fragmentation_block, &report, walked);
+
+		if (walked)
+		{
+			report.m_MagazineBytes += pool->m_cached.load(std::memory_order_relaxed);
+		}
+		else
+		{
+			report.m_OwnedPools         += 1;
+			report.m_OwnedReserved      += pool->m_segbytes.load(std::memory_order_relaxed);
+			report.m_OwnedFreeBytes     += pool->m_tinybytes.load(std::memory_order_relaxed) + pool->m_treebytes.load(std::memory_order_relaxed);
+			report.m_OwnedMagazineBytes += pool->m_cached.load(std::memory_order_relaxed);
+		}
+	}
+
+	if (report.m_FreeBytes)
+		report.m_Fragmentation = 1.0 - static_cast<double>(report.m_LargestFree) / static_cast<double>(report.m_FreeBytes);
+
+	report.m_HugeBlocks = m_HugeBlocks.load(std::memory_order_relaxed);
+	report.m_HugeBytes  = m_HugeBytes.load(std::memory_order_relaxed);
+
+	return report;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// the profile is created once and kept until the allocator is destroyed; the
+// frees keep attributing the sampled blocks to it after the sampling stops
+bool BlockAllocator::profile_start(size_t sample_rate)
+{
+	if (!BLOCK_PROFILE || !sample_rate)
+		return false;
+
+	p_heap_profile profile = m_Profile.load(std::memory_order_acquire);
+
+	if (!profile)
+	{
+		p_heap_profile fresh = m_heap_profile::create(sample_rate);
+		if (!fresh)
+			return false;
+
+		if (m_Profile.compare_exchange_strong(profile, fresh, std::memory_order_acq_rel))
+		{
+			profile = fresh;
+		}
+		else
+		{
+			m_heap_profile::destroy(fresh);
+		}
+	}
+
+	{
+		SCOPE_LOCK(profile->m_lock);
+		profile->m_rate = sample_rate;
+	}
+
+	m_SampleRate.store(sample_rate, std::memory_order_release);
+	return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void BlockAllocator::profile_stop()
+{
+	m_SampleRate.store(0, std::memory_order_relaxed);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+bool BlockAllocator::profile_dump(const char* path)
+{
+	p_heap_profile profile = m_Profile.load(std::memory_order_acquire);
+	if (!profile)
+		return false;
+
+	FILE* file = fopen(path, "w");
+	if (!file)
+		return false;
+
+	bool done = profile->dump(file);
+
+	return (fclose(file) == 0) && done;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// this routine counts the bytes down to the next sample; the distance
+// between the samples is drawn anew once the count is exhausted. caller
+// is the return address of the entry of the allocator, the sampled stack
+// starts from it
+INLINE void BlockAllocator::profile_malloc(void* umem, size_t size, void* caller)
+{
+	if (!BLOCK_PROFILE || !umem || !m_SampleRate.load(std::memory_order_relaxed))
+		return;
+
+	SampleEntry* entry = g_SampleCache.find(m_AllocatorId);
+
+	if (entry && size < entry->m_bytes)
+	{
+		entry->m_bytes -= size;
+		return;
+	}
+
+	profile_sample(umem, size, caller);
+}
+
+// the first distance of a thread is drawn before its first allocation from
+// the allocator is counted down, so that allocation is not sampled for sure
+void BlockAllocator::profile_sample(void* umem, size_t size, void* caller)
+{
+	p_heap_profile profile = m_Profile.load(std::memory_order_acquire);
+	if (!profile)
+		return;
+
+	size_t       rate  = m_SampleRate.load(std::memory_order_relaxed);
+	SampleEntry* entry = g_SampleCache.find(m_AllocatorId);
+
+	if (!entry)
+	{
+		entry = g_SampleCache.insert(m_AllocatorId);
+		entry->m_bytes = m_heap_profile::next_distance(g_SampleSeed, rate);
+
+		if (size < entry->m_bytes)
+		{
+			entry->m_bytes -= size;
+			return;
+		}
+	}
+
+	entry->m_bytes = m_heap_profile::next_distance(g_SampleSeed, rate);
+	profile->sample(umem, size, caller);
+}
+
+// the block is looked up in the profile only while it has sampled blocks
+// alive, and only if the filter of the profile says it may be one of them
+INLINE void BlockAllocator::profile_free(void* umem)
+{
+	if (!BLOCK_PROFILE)
+		return;
+
+	p_heap_profile profile = m_Profile.load(std::memory_order_acquire);
+
+	if (profile && profile->m_live.load(std::memory_order_relaxed))
+		profile->release(umem);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// the recorder is created once and kept until the allocator is destroyed, so
+// that a call which found the trace recorded never finds the recorder gone
+bool BlockAllocator::trace_start(const char* path)
+{
+	if (!BLOCK_TRACE)
+		return false;
+
+	p_trace_recorder recorder = m_Trace.load(std::memory_order_acquire);
+
+	if (!recorder)
+	{
+		p_trace_recorder fresh = m_trace_recorder::create();
+		if (!fresh)
+			return false;
+
+		if (m_Trace.compare_exchange_strong(recorder, fresh, std::memory_order_acq_rel))
+		{
+			recorder = fresh;
+		}
+		else
+		{
+			m_trace_recorder::destroy(fresh);
+		}
+	}
+
+	if (!recorder->open(path))
+		return false;
+
+	m_Tracing.store(true, std::memory_order_release);
+	return true;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// returns false if the trace could not be written completely
+bool BlockAllocator::trace_stop()
+{
+	p_trace_recorder recorder = m_Trace.load(std::memory_order_acquire);
+	if (!recorder)
+		return false;
+
+	m_Tracing.store(false, std::memory_order_relaxed);
+	return recorder->close();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+INLINE void BlockAllocator::trace(uint32_t op, void* umem, size_t size, size_t arg)
+{
+	if (BLOCK_TRACE && m_Tracing.load(std::memory_order_relaxed))
+		trace_record(op, umem, size, arg);
+}
+
+void BlockAllocator::trace_record(uint32_t op, void* umem, size_t size, size_t arg)
+{
+	p_trace_recorder recorder = m_Trace.load(std::memory_order_acquire);
+
+	if (recorder)
+		recorder->record(op, umem, size, arg);
+}
+
+// the recorder is locked over the call, since the block may be freed by it
+// (see m_trace_recorder::append)
+void* BlockAllocator::trace_realloc(void* umem, size_t size, void* caller)
+{
+	p_trace_recorder recorder = m_Trace.load(std::memory_order_acquire);
+	if (!recorder)
+		return pool_resize(umem, size, caller);
+
+	uint32_t thread = m_trace_recorder::thread_id();
+
+	SCOPE_LOCK(recorder->m_lock);
+
+	void* mem = pool_resize(umem, size, caller);
+	recorder->append(m_trace_record::Realloc, mem, size, reinterpret_cast<size_t>(umem), thread);
+
+	return mem;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// realloc allocates by this routine too, the samples are taken from its caller
+INLINE void* BlockAllocator::malloc(size_t size, void* caller)
+{
+	void* umem = pool_malloc(size, 0);
+
+	profile_malloc(umem, size, caller);
+	trace(m_trace_record::Malloc, umem, size, 0);
+
+	return umem;
+}
+
+void* BlockAllocator::malloc(size_t size)
+{
+	return malloc(size, RETURN_ADDRESS());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void* BlockAllocator::aligned_malloc(size_t alignment, size_t size)
+{
+	// the alignment is a power of two
+	if (alignment & (alignment - 1))
+		return NULL;
+
+	void* umem = pool_malloc(size, alignment);
+
+	profile_malloc(umem, size, RETURN_ADDRESS());
+	trace(m_trace_record::AlignedMalloc, umem, size, alignment);
+
+	return umem;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void BlockAllocator::free(void* umem)
+{
+	if (!umem)
+		return;
+
+	trace(m_trace_record::Free, umem, 0, 0);
+	profile_free(umem);
+
+	// pointers which do not belong to the allocator are ignored
+	p_pool_local pool = pool_lookup(umem);
+
+	if (pool == m_page_map::huge_mark())
+	{
+		huge_free(umem);
+	}
+	else if (pool)
+	{
+		pool->free(umem, 0);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void BlockAllocator::free_sized(void* umem, size_t size)
+{
+	if (!umem)
+		return;
+
+	trace(m_trace_record::Free, umem, size, 0);
+	profile_free(umem);
+
+	p_pool_local pool = pool_lookup(umem);
+
+	// the block is at least as large as the caller claims, so the owner
+	// caches it by the size of the block holding size bytes, without
+	// reading the header of the block
+	if (pool == m_page_map::huge_mark())
+	{
+		assert(mem_to_huge(umem)->m_user >= size);
+		huge_free(umem);
+	}
+	else if (pool)
+	{
+		assert(mem_to_blk(umem)->user_size() >= size);
+		pool->free(umem, m_pool_local::calc_blck_size(size));
+	}
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+size_t BlockAllocator::malloc_batch(size_t size, size_t count, void** umem)
+{
+	size_t done = 0;
+
+	// the owner allocates the batch from its pool without locking it
+	p_pool_local pool = pool_local();
+
+	if (pool && size < m_huge_block::Threshold)
+		done = pool->local_malloc_batch(size, count, umem);
+
+	// the rest is allocated one by one from the pools of the other threads
+	for (; done < count; done++)
+	{
+		umem[done] = pool_malloc(size, 0);
+
+		if (umem[done] == NULL)
+			break;
+	}
+
+	for (size_t i = 0; i < done; i++)
+	{
+		profile_malloc(umem[i], size, RETURN_ADDRESS());
+		trace(m_trace_record::Malloc, umem[i], size, 0);
+	}
+
+	return done;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void BlockAllocator::free_batch(void** umem, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (umem[i])
+		{
+			trace(m_trace_record::Free, umem[i], 0, 0);
+			profile_free(umem[i]);
+		}
+	}
+
+	// the blocks are freed by runs of the blocks of the same pool, so
+	// that every run takes the lock (or the remote list) of its pool once
+	for (size_t i = 0; i < count; )
+	{
+		if (!umem[i])
+		{
+			i += 1;
+			continue;
+		}
+
+		p_pool_local pool = pool_lookup(umem[i]);
+		size_t       next = i + 1;
+
+		while (next < count && umem[next] && pool_lookup(umem[next]) == pool)
+			next += 1;
+
+		if (pool == m_page_map::huge_mark())
+		{
+			for (size_t j = i; j < next; j++)
+				huge_free(umem[j]);
+		}
+		else if (pool)
+		{
+			pool->free_batch(umem + i, next - i);
+		}
+
+		i = next;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void* BlockAllocator::realloc(void* umem, size_t size)
+{
+	if (!umem)
+		return malloc(size, RETURN_ADDRESS());
+
+	if (!size)
+	{
+		free(umem);
+		return NULL;
+	}
+
+	if (BLOCK_TRACE && m_Tracing.load(std::memory_order_relaxed))
+		return trace_realloc(umem, size, RETURN_ADDRESS());
+
+	return pool_resize(umem, size, RETURN_ADDRESS());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void* BlockAllocator::pool_resize(void* umem, size_t size, void* caller)
+{
+	p_pool_local pool = pool_lookup(umem);
+
+	// pointers which do not belong to the allocator are not resized
+	if (!pool)
+		return NULL;
+
+	// the block is sampled anew once it is resized
+	profile_free(umem);
+
+	void* mem = (pool == m_page_map::huge_mark()) ? huge_realloc(umem, size) : pool_realloc(pool, umem, size);
+
+	profile_malloc(mem, size, caller);
+	return mem;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// the block is resized in place if its neighbours allow, otherwise it is
+// moved to a new block; a block grown to the threshold becomes a huge one
+void* BlockAllocator::pool_realloc(p_pool_local pool, void* umem, size_t size)
+{
+	void* mem = (size < m_huge_block::Threshold) ? pool->realloc(umem, size) : NULL;
+	if (mem)
+		return mem;
+
+	mem = pool_malloc(size, 0);
+	if (mem)
+	{
+		size_t used = mem_to_blk(umem)->user_size();
+		memcpy(mem, umem, (used < size) ? used : size);
+
+		pool->free(umem, 0);
+	}
+
+	return mem;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// maps a huge block on its own: its range is reserved by whole grains aligned
+// to them (or to the alignment if it is larger), so that the block owns the
+// grains it spans in the page map
+void* BlockAllocator::huge_malloc(size_t size, size_t alignment)
+{
+	if (!m_PageMap)
+		return NULL;
+
+	if (alignment < m_pool_local::MinAlignment)
+		alignment = m_pool_local::MinAlignment;
+
+	size_t head = (sizeof(m_huge_block) + alignment - 1) & ~(alignment - 1);
+
+	if (size > (size_t)0 - head - alignment - m_page_map::GrainSize)
+		return NULL;
+
+	size_t gran = page_granularity();
+	size_t used = (head + size + gran - 1) & ~(gran - 1);
+	size_t span = (used + m_page_map::GrainSize - 1) & ~(size_t)(m_page_map::GrainSize - 1);
+
+	char* addr = static_cast<char*>(page_reserve_aligned(span, (alignment > m_page_map::GrainSize) ? alignment : (size_t)m_page_map::GrainSize));
+	if (!addr)
+		return NULL;
+
+	if (!page_commit(addr, used) || !m_PageMap->insert(addr, span, m_page_map::huge_mark()))
+	{
+		m_PageMap->erase(addr, span);
+		page_free(addr, span);
+		return NULL;
+	}
+
+	p_huge_block huge = mem_to_huge(addr + head);
+
+	huge->m_addr = addr;
+	huge->m_size = span;
+	huge->m_used = used;
+	huge->m_user = size;
+
+	m_HugeBlocks.fetch_add(1, std::memory_order_relaxed);
+	m_HugeBytes.fetch_add(used, std::memory_order_relaxed);
+
+	return addr + head;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void BlockAllocator::huge_free(void* umem)
+{
+	p_huge_block huge = mem_to_huge(umem);
+
+	char*  addr = huge->m_addr;
+	size_t size = huge->m_size;
+
+	m_HugeBlocks.fetch_sub(1, std::memory_order_relaxed);
+	m_HugeBytes.fetch_sub(huge->m_used, std::memory_order_relaxed);
+
+	m_PageMap->erase(addr, size);
+	page_free(addr, size);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+// resizes the huge block: within its range the pages are committed or given
+// back to the OS; beyond it a larger range is reserved and the pages of the
+// block are moved there without copying them where the OS can (mremap), or
+// copied otherwise. A block shrunk below the threshold moves to the pools
+void* BlockAllocator::huge_realloc(void* umem, size_t size)
+{
+	p_huge_block huge = mem_to_huge(umem);
+	size_t       head = static_cast<char*>(umem) - huge->m_addr;
+
+	if (size < m_huge_block::Threshold)
+	{
+		void* mem = pool_malloc(size, 0);
+		if (mem)
+		{
+			memcpy(mem, umem, size);
+			huge_free(umem);
+		}
+
+		return mem;
+	}
+
+	if (size > (size_t)0 - head - m_page_map::GrainSize)
+		return NULL;
+
+	size_t gran = page_granularity();
+	size_t used = (head + size + gran - 1) & ~(gran - 1);
+
+	if (used <= huge->m_size)
+	{
+		if (used > huge->m_used)
+		{
+			if (!page_commit(huge->m_addr + huge->m_used, used - huge->m_used))
+				return NULL;
+		}
+		else if (used < huge->m_used)
+		{
+			page_decommit(huge->m_addr + used, huge->m_used - used);
+		}
+
+		m_HugeBytes.fetch_add(used - huge->m_used, std::memory_order_relaxed);
+
+		huge->m_used = used;
+		huge->m_user = size;
+
+		return umem;
+	}
+
+	size_t span = (used + m_page_map::GrainSize - 1) & ~(size_t)(m_page_map::GrainSize - 1);
+
+	char* addr = static_cast<char*>(page_reserve_aligned(span, m_page_map::GrainSize));
+	if (!addr)
+		return NULL;
+
+	if (!page_commit(addr, used) || !m_PageMap->insert(addr, span, m_page_map::huge_mark()))
+	{
+		m_PageMap->erase(addr, span);
+		page_free(addr, span);
+		return NULL;
+	}
+
+	// the header moves along with the pages, so the old range is noted first
+	char*  prev_addr = huge->m_addr;
+	size_t prev_size = huge->m_size;
+
+	m_HugeBytes.fetch_add(used - huge->m_used, std::memory_order_relaxed);
+
+	if (!page_remap(prev_addr, huge->m_used, addr))
+		memcpy(addr, prev_addr, head + huge->m_user);
+
+	huge = mem_to_huge(addr + head);
+
+	huge->m_addr = addr;
+	huge->m_size = span;
+	huge->m_used = used;
+	huge->m_user = size;
+
+	m_PageMap->erase(prev_addr, prev_size);
+	page_free(prev_addr, prev_size);
+
+	return addr + head;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+p_pool_local BlockAllocator::pool_construct(size_t capacity)
+{
+	p_pool_local pool = NULL;
+
+	if (!m_PageMap)
+		return NULL;
+
+	if (capacity > m_pool_local::MaxSize)
+		capacity = m_pool_local::MaxSize;
+
+	size_t size = (capacity + m_page_map::GrainSize - 1) & ~(size_t)(m_page_map::GrainSize - 1); // align capacity to the grains of the page map
+
+	void* memory = page_reserve_aligned(size, m_page_map::GrainSize);
+	if (!memory)
+		return NULL;
+
+	// only the pool header is committed up front,
+	// the rest of the range is committed by the foot
+	size_t head = (sizeof(m_pool_local) + m_pool_local::FenceSize + m_pool_local::CommitSize - 1) & ~(size_t)(m_pool_local::CommitSize - 1);
+	if (head > size)
+		head = size;
+
+	pool = static_cast<p_pool_local>(memory);
+
+	if (!page_commit(memory, head) || !m_PageMap->insert(memory, size, pool))
+	{
+		m_PageMap->erase(memory, size);
+		page_free(memory, size);
+		return NULL;
+	}
+
+	pool->init(m_PageMap, size, head);
+
+	return pool;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void BlockAllocator::pool_destruct(p_pool_local pool)
+{
+	if (pool)
+	{
+		pool->fini();
+
+		m_PageMap->erase(pool, pool->m_segment.m_size);
+		page_free(pool, pool->m_segment.m_size);
+	}
+}	
+
+////////////////////////////////////////////////////////////////////////////////
+
+p_pool_local BlockAllocator::pool_find(size_t indx) const
+{
+	if (indx >= MaxThreadCount)
+		return NULL;
+
+	p_pool_chunk chunk = m_ThreadPool[indx / DirectoryChunk].load(std::memory_order_acquire);
+	if (!chunk)
+		return NULL;
+
+	return chunk[indx % DirectoryChunk].load(std::memory_order_acquire);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// creates a pool in the next slot of the directory; the directory is grown
+// without locking: a new chunk is published with a CAS and the loser of a
+// race frees its copy. The pool is bound to its owner before it is published,
+// so no thread scanning the directory takes it for a pool left by an exited one
+p_pool_local BlockAllocator::pool_create(const void* owner)
+{
+	size_t indx = m_ThreadCount.fetch_add(1, std::memory_order_acq_rel);
+
+	if (indx >= MaxThreadCount)
+		return NULL;
+
+	ATOMIC_VALUE(p_pool_chunk)& slot = m_ThreadPool[indx / DirectoryChunk];
+
+	p_pool_chunk chunk = slot.load(std::memory_order_acquire);
+	if (!chunk)
+	{
+		p_pool_chunk fresh = static_cast<p_pool_chunk>(page_alloc(sizeof(chunk[0]) * DirectoryChunk));
+		if (!fresh)
+			return NULL;
+
+		// fresh pages are zero filled, that is a chunk of NULL pools
+		if (slot.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+		{
+			chunk = fresh;
+		}
+		else
+		{
+			page_free(fresh, sizeof(chunk[0]) * DirectoryChunk);
+		}
+	}
+
+	p_pool_local pool = pool_construct(m_Capacity);
+	if (!pool)
+		return NULL;
+
+	pool->m_indx = indx;
+	pool->m_owner.store(owner, std::memory_order_relaxed);
+	chunk[indx % DirectoryChunk].store(pool, std::memory_order_release);
+
+	return pool;
+}
+
+
+//===================================================================================
+//
+// operator new:
+
+#if defined(BLOCK_REPLACE_OPERATOR_NEW)
+
+namespace
+{
+	// the allocator is never destroyed, the blocks may still
+	// be freed by the destructors of the static objects
+	INLINE BlockAllocator& global_allocator()
+	{
+		alignas(BlockAllocator) static char storage[sizeof(BlockAllocator)];
+		static BlockAllocator* allocator = new (storage) BlockAllocator();
+
+		return *allocator;
+	}
+
+#if defined(__STDCPP_DEFAULT_NEW_ALIGNMENT__)
+	const size_t DefaultNewAlignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+#else
+	const size_t DefaultNewAlignment = m_pool_local::MinAlignment;
+#endif
+
+	// allocates the memory for the operator new with the alignment it
+	// guarantees at least; the installed new handler is called until
+	// the allocation succeeds, bad_alloc is thrown once there is none
+	void* global_new(size_t size, size_t alignment)
+	{
+		if (alignment < DefaultNewAlignment)
+			alignment = DefaultNewAlignment;
+
+		for (;;)
+		{
+			void* umem = (alignment > m_pool_local::MinAlignment) ? global_allocator().aligned_malloc(alignment, size) : global_allocator().malloc(size);
+			if (umem)
+				return umem;
+
+			std::new_handler handler = std::get_new_handler();
+			if (!handler)
+				throw std::bad_alloc();
+
+			handler();
+		}
+	}
+
+	INLINE void* global_new_nothrow(size_t size, size_t alignment) noexcept
+	{
+		try
+		{
+			return global_new(size, alignment);
+		}
+		catch (...)
+		{
+			return NULL;
+		}
+	}
+}
+
+void* operator new(size_t size)
+{
+	return global_new(size, DefaultNewAlignment);
+}
+
+void* operator new[](size_t size)
+{
+	return global_new(size, DefaultNewAlignment);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return global_new_nothrow(size, DefaultNewAlignment);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return global_new_nothrow(size, DefaultNewAlignment);
+}
+
+void operator delete(void* umem) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete[](void* umem) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete(void* umem, const std::nothrow_t&) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete[](void* umem, const std::nothrow_t&) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete(void* umem, size_t size) noexcept
+{
+	global_allocator().free_sized(umem, size);
+}
+
+void operator delete[](void* umem, size_t size) noexcept
+{
+	global_allocator().free_sized(umem, size);
+}
+
+#if defined(__cpp_aligned_new)
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	return global_new(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return global_new(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return global_new_nothrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return global_new_nothrow(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* umem, std::align_val_t) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete[](void* umem, std::align_val_t) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete(void* umem, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete[](void* umem, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	global_allocator().free(umem);
+}
+
+void operator delete(void* umem, size_t size, std::align_val_t) noexcept
+{
+	global_allocator().free_sized(umem, size);
+}
+
+void operator delete[](void* umem, size_t size, std::align_val_t) noexcept
+{
+	global_allocator().free_sized(umem, size);
+}
+
+#endif // __cpp_aligned_new
 
+#endif // BLOCK_REPLACE_OPERATOR_NEW
@@ -10,6 +10,12 @@
 //
 // public:
 
+// thread_local_capacity is the size of the address range reserved for each
+// thread local memory pool; the range is committed as it is used and further
+// ranges are chained to a pool once it runs out. A pool is created when a
+// thread allocates from the allocator for the first time and it is handed
+// over to another thread once its thread exits; every allocator binds the
+// threads to its pools on its own.
 class BlockAllocator
 {
 public:
@@ -19,20 +25,209 @@ public:
 	void* malloc(size_t size);
 	void  free(void* umem);
 
+	// size is the one the block was allocated with (or the one
+	// it was reallocated with, the last time); the owner of the
+	// pool caches the block by it without reading its header
+	void  free_sized(void* umem, size_t size);
+
+	void* realloc(void* umem, size_t size);
+
+	// allocates count blocks of the same size into umem,
+	// returns the number of the blocks allocated
+	size_t malloc_batch(size_t size, size_t count, void** umem);
+	void   free_batch(void** umem, size_t count);
+
+	// alignment is a power of two, the blocks are aligned to
+	// twice the size of a pointer at least
+	void* aligned_malloc(size_t alignment, size_t size);
+
+	// counters of the allocations the pool of the calling thread could not
+	// serve, which fell back to the pools other threads gave up
+	struct FallbackStats
+	{
+		size_t m_Fallbacks;  // allocations served by another pool
+		size_t m_Busy;       // pools found locked on the way
+		size_t m_Migrations; // threads which moved to the pool they fell back to
+	};
+
+	FallbackStats fallback_stats() const;
+
+	// a snapshot of the counters of the allocator summed over its pools; the
+	// pools run meanwhile, so the counters agree with each other only roughly
+	struct Stats
+	{
+		enum
+		{
+			BinCount = 64 // the 32 lists of the small blocks by 8 bytes, then the 32 trees by the powers of two
+		};
+
+		size_t m_Pools;      // pools created
+		size_t m_OwnedPools; // pools bound to a live thread
+		size_t m_Segments;   // address ranges reserved by the pools
+		size_t m_Reserved;   // bytes of those ranges
+
+		size_t m_Mallocs[BinCount]; // blocks allocated, by the bins of their sizes
+		size_t m_Frees[BinCount];   // blocks freed, by the bins of their sizes (the ones given to free_sized)
+
+		size_t m_FootBytes;      // bytes carved from the foots
+		size_t m_Coalesced;      // free blocks merged with their neighbours
+		size_t m_ForeignMallocs; // blocks allocated from the pools nobody owns (the fallback hits)
+		size_t m_RemoteFrees;    // blocks freed by the threads other than the owner
+		size_t m_LockFailures;   // times the pools were found locked
+
+		size_t m_TinyBytes;     // bytes cached in the lists of the small blocks
+		size_t m_TreeBytes;     // bytes cached in the trees
+		size_t m_MagazineBytes; // bytes cached in the magazines of the owners, by the sizes of the magazines
+
+		size_t m_HugeBlocks; // live blocks mapped on their own
+		size_t m_HugeBytes;  // bytes committed for them
+
+		FallbackStats m_Fallback;
+	};
+
+	Stats stats() const;
+
+	// samples about one allocation per sample_rate bytes into the heap profile
+	// of the allocator, with the stacks they come from; the samples are kept
+	// until their blocks are freed, even once the sampling is stopped
+	bool profile_start(size_t sample_rate = 0x80000);
+	void profile_stop();
+
+	// writes the sampled blocks in the legacy heap format of pprof
+	bool profile_dump(const char* path);
+
+	// a block of a pool as reported by walk
+	struct BlockInfo
+	{
+		size_t m_Pool; // index of the pool
+		void*  m_Addr; // user memory of the block
+		size_t m_Size; // bytes of the block, its header included
+		bool   m_Used; // allocated, or cached by a magazine or the remote list of the pool
+		bool   m_Foot; // the free rest of a segment, which the new blocks are carved from
+	};
+
+	// returns false to stop the walk; the routine must not use the allocator
+	using WalkCallback = bool (*)(const BlockInfo& info, void* context);
+
+	// reports every block of the pools in the order of the addresses within
+	// a segment; the huge blocks are not reported. The pool of the calling
+	// thread is walked as is, a pool nobody owns is locked while it is walked;
+	// the pools owned by the other threads are skipped, since their owners
+	// change them without locking. Returns false if the routine stopped the walk
+	bool walk(WalkCallback callback, void* context);
+
+	// the state of the free memory of the pools, taken by walk; the pools
+	// skipped by the walk are reported by the counters their owners keep
+	struct FragmentationReport
+	{
+		size_t m_UsedBlocks; // blocks in use, the ones cached by the magazines and the remote lists included
+		size_t m_UsedBytes;  // bytes of them
+		size_t m_FreeBlocks; // blocks cached in the bins
+		size_t m_FreeBytes;  // bytes of them
+
+		size_t m_FreeBins[Stats::BinCount]; // bytes cached, by the bins (see Stats)
+		size_t m_LargestFree;               // the largest block cached in the bins
+
+		// 1 - m_LargestFree / m_FreeBytes, the share of the free bytes which
+		// a request of their total size could not use; 0 if nothing is free
+		double m_Fragmentation;
+
+		size_t m_FootBytes;   // bytes left in the foots of the pools
+		size_t m_LargestFoot; // the largest of the foots
+
+		size_t m_MagazineBytes; // bytes of m_UsedBytes cached by the magazines
+
+		size_t m_OwnedPools;         // pools owned by the other threads, not walked
+		size_t m_OwnedReserved;      // bytes reserved by them
+		size_t m_OwnedFreeBytes;     // bytes cached in their bins
+		size_t m_OwnedMagazineBytes; // bytes cached in their magazines
+
+		size_t m_HugeBlocks; // live blocks mapped on their own
+		size_t m_HugeBytes;  // bytes committed for them
+	};
+
+	FragmentationReport fragmentation();
+
+	// records every call of the allocator into the trace file at path, until
+	// trace_stop; the threads are serialized while the trace is recorded. The
+	// format is described in trace_recorder.hpp, the benchmark replays it
+	bool trace_start(const char* path);
+	bool trace_stop();
+
 private:
 	enum
 	{
-		MaxThreadCount = 0x10
+		DirectoryChunk  = 0x200,  // the directory of pools is grown by chunks of this many pools
+		DirectorySize   = 0x80,   // chunks in the directory
+		MaxThreadCount  = DirectoryChunk * DirectorySize,
+		DefaultCapacity = (sizeof(void*) > 4) ? 0x4000000 : 0x800000,
+		MigrateStrikes  = 0x40    // fallbacks in a row to the same pool after which the thread moves to it
 	};
 
 	using p_pool_local = struct m_pool_local*;
-	p_pool_local m_ThreadPool[MaxThreadCount]; //array of internal thread local memory pools
+	using p_pool_chunk = ATOMIC_VALUE(p_pool_local)*;
+	ATOMIC_VALUE(p_pool_chunk) m_ThreadPool[DirectorySize]; //directory of internal thread local memory pools
+
+	using p_page_map = struct m_page_map*;
+	p_page_map m_PageMap; // maps the address ranges of the pools to the pools
 
 private:
 	p_pool_local pool_construct(size_t capacity);
 	void         pool_destruct(p_pool_local pool);
 
+	p_pool_local pool_find(size_t indx) const;
+	p_pool_local pool_lookup(void* umem);
+	p_pool_local pool_create(const void* owner);
+	bool         pool_walk(p_pool_local pool, WalkCallback callback, void* context, bool& walked);
+
+	p_pool_local pool_local();
+	void*        pool_malloc(size_t size, size_t alignment);
+	void*        pool_fallback(p_pool_local home, size_t size, size_t alignment);
+	p_pool_local pool_bind();
+	void         pool_release(const void* token);
+
+	void*        huge_malloc(size_t size, size_t alignment);
+	void         huge_free(void* umem);
+	void*        huge_realloc(void* umem, size_t size);
+
+	void*        pool_realloc(p_pool_local pool, void* umem, size_t size);
+	void*        pool_resize(void* umem, size_t size, void* caller);
+
+	void*        malloc(size_t size, void* caller);
+
+	void         profile_malloc(void* umem, size_t size, void* caller);
+	void         profile_sample(void* umem, size_t size, void* caller);
+	void         profile_free(void* umem);
+
+	void         trace(uint32_t op, void* umem, size_t size, size_t arg);
+	void         trace_record(uint32_t op, void* umem, size_t size, size_t arg);
+	void*        trace_realloc(void* umem, size_t size, void* caller);
+
 private:
-	ATOMIC_VALUE(uint16_t) m_ThreadCount;
-	THREAD_LOCAL(uint16_t) m_ThreadIndex;
+	struct ThreadGuard;
+
+	size_t                 m_Capacity;
+	size_t                 m_AllocatorId;   // unique id of the allocator, keys the thread local cache of pools
+	BlockAllocator*        m_NextAllocator; // link in the list of live allocators
+
+	// number of the slots taken in the directory of pools; it is read by every
+	// thread walking the pools, so it is kept on a line of its own
+	alignas(CACHE_LINE) ATOMIC_VALUE(size_t) m_ThreadCount;
+	char m_ThreadCountPad[CACHE_LINE - sizeof(ATOMIC_VALUE(size_t))];
+
+	// the counters of the fallbacks, written by the threads falling back only,
+	// and the counters of the huge blocks
+	alignas(CACHE_LINE) ATOMIC_VALUE(size_t) m_Fallbacks;
+	ATOMIC_VALUE(size_t) m_FallbackBusy;
+	ATOMIC_VALUE(size_t) m_Migrations;
+	ATOMIC_VALUE(size_t) m_HugeBlocks;
+	ATOMIC_VALUE(size_t) m_HugeBytes;
+
+	using p_heap_profile = struct m_heap_profile*;
+	ATOMIC_VALUE(p_heap_profile) m_Profile;    // the samples, created by the first profile_start
+	ATOMIC_VALUE(size_t)         m_SampleRate; // mean bytes between the samples, 0 while not sampling
+
+	using p_trace_recorder = struct m_trace_recorder*;
+	ATOMIC_VALUE(p_trace_recorder) m_Trace;   // the recorder, created by the first trace_start
+	ATOMIC_VALUE(bool)             m_Tracing; // whether the calls are recorded
 };
\ No newline at end of file
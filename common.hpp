@@ -3,28 +3,72 @@
 //
 // externals:
 
+#include <new>
 #include <mutex>
 #include <atomic>
 #include <assert.h>
 #include <stdint.h>
+
+#if defined(_WIN32)
 #include <windows.h>
+#include <intrin.h>
+#pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <thread>
+#endif
 
 //===================================================================================
 //
 // publics:
 
+#if defined(_WIN32)
+
 #define BSR                        _BitScanReverse
+#define BSF                        _BitScanForward
+#define INLINE                     __forceinline
+#define RETURN_ADDRESS()           _ReturnAddress()
+#define CPU_PAUSE()                YieldProcessor()
+
+#else
+
+#define BSR(index, mask)           ((*(index) = (mask) != 0 ? (sizeof(unsigned long) * 8 - 1) ^ __builtin_clzl(mask) : 0), (mask) != 0)
+#define BSF(index, mask)           ((*(index) = (mask) != 0 ? __builtin_ctzl(mask) : 0), (mask) != 0)
+#define INLINE                     inline __attribute__((always_inline))
+#define RETURN_ADDRESS()           __builtin_return_address(0)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_PAUSE()                __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_PAUSE()                __asm__ __volatile__("yield")
+#else
+#define CPU_PAUSE()                ((void)0)
+#endif
+
+#endif
+
+// the pools are locked by a spin lock parking the threads which wait for
+// too long; define USE_STD_MUTEX to lock them by std::mutex instead
+#if defined(USE_STD_MUTEX)
 #define LOCK                       std::mutex
+#else
+#define LOCK                       SpinLock
+#endif
+
+#define CACHE_LINE                 64
 #define VOID_0                     reinterpret_cast<void*>(0u)
 #define VOID_1                     reinterpret_cast<void*>(1u)
-#define INLINE                     __forceinline
 #define CAST(value)                reinterpret_cast<void*>(value)
 #define SCOPE_LOCK(lock)           ScopedLock var(&lock);
 #define SCOPE_LOCK_AFTER_TRY(lock) ScopedLock var(&lock, 0);
 
 
 #define ATOMIC_VALUE(type) std::atomic<type>
-#define THREAD_LOCAL(type) __declspec(thread) static type
+#define THREAD_LOCAL(type) static thread_local type
+#define THREAD_LOCAL_DEF(type) thread_local type
 
 #define DELETE_CONSTRUCTOR_AND_DESTRUCTOR(classname) \
     classname() = delete; \
@@ -52,6 +96,90 @@ INLINE ret_t sub_mem(mem_t mem, count_t count)
 //
 // publics:
 
+// Test-and-test-and-set lock: the waiting thread spins on a plain load with
+// exponential backoff, then marks the lock contended and parks on its word
+// (futex on Linux, WaitOnAddress on Windows, yielding elsewhere). The word is
+// 0 when the lock is free, 1 when it is taken and 2 when a thread may be
+// parked on it, so an unlock wakes somebody only after contention.
+struct SpinLock
+{
+	enum
+	{
+		MaxBackoff = 0x400 // pauses between the tests of the last round of spinning
+	};
+
+	ATOMIC_VALUE(uint32_t) m_state;
+
+	constexpr SpinLock()
+		: m_state(0)
+	{
+	}
+
+	SpinLock(const SpinLock&) = delete;
+	SpinLock& operator=(const SpinLock&) = delete;
+
+	INLINE bool try_lock()
+	{
+		uint32_t state = 0;
+
+		return m_state.load(std::memory_order_relaxed) == 0 &&
+			m_state.compare_exchange_strong(state, 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	INLINE void lock()
+	{
+		if (!try_lock())
+			lock_contended();
+	}
+
+	INLINE void unlock()
+	{
+		if (m_state.exchange(0, std::memory_order_release) == 2)
+			wake();
+	}
+
+	void lock_contended()
+	{
+		for (uint32_t backoff = 1; backoff <= MaxBackoff; backoff <<= 1)
+		{
+			for (uint32_t i = 0; i < backoff; i++)
+				CPU_PAUSE();
+
+			if (try_lock())
+				return;
+		}
+
+		// whoever takes the lock now has to wake the others on unlock
+		while (m_state.exchange(2, std::memory_order_acquire) != 0)
+			wait(2);
+	}
+
+	// sleeps while the word of the lock holds the state
+	INLINE void wait(uint32_t state)
+	{
+#if defined(_WIN32)
+		WaitOnAddress(&m_state, &state, sizeof(state), INFINITE);
+#elif defined(__linux__)
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_state), FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+#else
+		(void)state;
+		std::this_thread::yield();
+#endif
+	}
+
+	// wakes a thread parked on the word of the lock
+	INLINE void wake()
+	{
+#if defined(_WIN32)
+		WakeByAddressSingle(&m_state);
+#elif defined(__linux__)
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_state), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////
+
 struct ScopedLock
 {
 	INLINE ScopedLock(LOCK* lock, int)
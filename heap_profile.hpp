@@ -0,0 +1,336 @@
+#pragma once
+//===================================================================================
+//
+// externals:
+
+#include <math.h>
+#include <stdio.h>
+
+#include "common.hpp"
+#include "page_provider.hpp"
+
+#if !defined(_WIN32)
+#include <execinfo.h>
+#endif
+
+
+//===================================================================================
+//
+// publics:
+
+// The heap profile keeps the allocations sampled by an allocator: about one
+// allocation per m_rate bytes is sampled, its stack is captured and the block
+// is entered into a table keyed by its user memory, so that its free is
+// attributed to the same stack. The tables live in pages of their own and have
+// a fixed capacity, the allocator is never used by the profile. A sampled
+// allocation or free takes the lock of the profile; the other frees only look
+// into a filter of counters indexed by the hash of the user memory, which is
+// read without locking.
+struct m_heap_profile
+{
+	enum
+	{
+		MaxDepth    = 32,      // frames of a stack kept at most
+		SkipDepth   = 8,       // frames of the allocator on the top of a stack at most
+		StackCount  = 0x2000,  // distinct stacks kept at most
+		SampleCount = 0x10000, // sampled blocks alive at most
+		FilterCount = 0x10000  // counters of the filter of the sampled blocks
+	};
+
+	struct m_stack
+	{
+		size_t m_hash;  // hash of the frames, 0 marks an empty slot
+		size_t m_depth; // number of the frames
+		void*  m_frames[MaxDepth];
+
+		size_t m_allocs;      // sampled allocations
+		size_t m_allocbytes;  // bytes of them
+		size_t m_inuse;       // sampled allocations not freed yet
+		size_t m_inusebytes;  // bytes of them
+	};
+
+	struct m_sample
+	{
+		void*    m_umem;  // user memory of the sampled block, NULL marks an empty slot
+		size_t   m_size;  // bytes requested
+		m_stack* m_trace; // the stack the block was allocated from
+	};
+
+	LOCK   m_lock; // guards the tables
+	size_t m_rate; // mean distance between the samples in bytes, as of the last start
+
+	ATOMIC_VALUE(size_t)  m_live;                // sampled blocks alive, read by every free
+	ATOMIC_VALUE(uint16_t) m_filter[FilterCount]; // sampled blocks alive by the hash of their user memory
+
+	size_t   m_dropped;              // samples not kept since a table was full
+	m_sample m_samples[SampleCount]; // open addressing, linear probing
+	m_stack  m_stacks[StackCount];   // open addressing, linear probing
+
+	// the profile is placed into fresh pages, which are zero filled
+	INLINE static m_heap_profile* create(size_t rate)
+	{
+		m_heap_profile* profile = static_cast<m_heap_profile*>(page_alloc(sizeof(m_heap_profile)));
+
+		if (profile)
+		{
+			new (&profile->m_lock) LOCK();
+			profile->m_rate = rate;
+		}
+
+		// the unwinder is loaded by the first capture, which may allocate
+		void* frames[MaxDepth];
+		capture(frames, NULL);
+
+		return profile;
+	}
+
+	INLINE static void destroy(m_heap_profile* profile)
+	{
+		if (profile)
+			page_free(profile, sizeof(m_heap_profile));
+	}
+
+	INLINE static size_t hash(void* umem)
+	{
+		return (reinterpret_cast<size_t>(umem) >> 3) * static_cast<size_t>(0x9E3779B97F4A7C15ull);
+	}
+
+	// captures the stack from the frame the allocator was called from: caller
+	// is the return address of the entry of the allocator, the frames above it
+	// are the allocator's own and are dropped. If caller is not among the top
+	// frames (the entry was inlined), only the frame of the profile is dropped
+	INLINE static size_t capture(void** frames, void* caller)
+	{
+		void*  stack[MaxDepth + SkipDepth];
+#if defined(_WIN32)
+		size_t depth = ::CaptureStackBackTrace(0, MaxDepth + SkipDepth, stack, NULL);
+#else
+		size_t depth = ::backtrace(stack, MaxDepth + SkipDepth);
+#endif
+		size_t skip = 1;
+
+		for (size_t i = 0; i < depth && i < SkipDepth; i++)
+		{
+			if (stack[i] == caller)
+			{
+				skip = i;
+				break;
+			}
+		}
+
+		if (depth > skip + MaxDepth)
+			depth = skip + MaxDepth;
+
+		for (size_t i = skip; i < depth; i++)
+			frames[i - skip] = stack[i];
+
+		return (depth > skip) ? depth - skip : 0;
+	}
+
+	// the distance to the next sample is drawn from the exponential distribution
+	// with the mean of the rate, so that the samples do not follow the pattern of
+	// the allocations; the generator is a xorshift seeded by the thread
+	INLINE static size_t next_distance(uint64_t& seed, size_t rate)
+	{
+		if (!seed)
+			seed = reinterpret_cast<size_t>(&seed) | 1;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		double u = (static_cast<double>(seed >> 11) + 1.0) * (1.0 / 9007199254740992.0);
+
+		return static_cast<size_t>(-::log(u) * static_cast<double>(rate)) + 1;
+	}
+
+	// this routine is used by the thread which allocated the block, before the
+	// block is handed out; caller is the return address of the allocator entry
+	void sample(void* umem, size_t size, void* caller)
+	{
+		void*  frames[MaxDepth];
+		size_t depth = capture(frames, caller);
+
+		size_t code = depth;
+		for (size_t i = 0; i < depth; i++)
+			code = (code ^ reinterpret_cast<size_t>(frames[i])) * static_cast<size_t>(0x100000001B3ull);
+
+		code |= 1;
+
+		SCOPE_LOCK(m_lock);
+
+		m_stack* stack = find_stack(code, frames, depth);
+
+		size_t indx = hash(umem) >> 16;
+		size_t left = SampleCount;
+
+		while (left && m_samples[indx % SampleCount].m_umem)
+		{
+			indx += 1;
+			left -= 1;
+		}
+
+		if (!stack || !left)
+		{
+			m_dropped += 1;
+			return;
+		}
+
+		m_sample* sample = &m_samples[indx % SampleCount];
+
+		sample->m_umem  = umem;
+		sample->m_size  = size;
+		sample->m_trace = stack;
+
+		stack->m_allocs     += 1;
+		stack->m_allocbytes += size;
+		stack->m_inuse      += 1;
+		stack->m_inusebytes += size;
+
+		m_filter[hash(umem) % FilterCount].fetch_add(1, std::memory_order_relaxed);
+		m_live.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// this routine is used by every free while some sampled blocks are alive
+	INLINE void release(void* umem)
+	{
+		if (m_filter[hash(umem) % FilterCount].load(std::memory_order_relaxed))
+			release_sample(umem);
+	}
+
+	// removes the sample of the block if there is one; the slots after it are
+	// shifted back, so the probing needs no tombstones
+	void release_sample(void* umem)
+	{
+		SCOPE_LOCK(m_lock);
+
+		size_t indx = hash(umem) >> 16;
+		size_t left = SampleCount;
+
+		while (left && m_samples[indx % SampleCount].m_umem != umem)
+		{
+			if (!m_samples[indx % SampleCount].m_umem)
+				return;
+
+			indx += 1;
+			left -= 1;
+		}
+
+		if (!left)
+			return;
+
+		m_sample* sample = &m_samples[indx % SampleCount];
+
+		sample->m_trace->m_inuse      -= 1;
+		sample->m_trace->m_inusebytes -= sample->m_size;
+
+		m_filter[hash(umem) % FilterCount].fetch_sub(1, std::memory_order_relaxed);
+		m_live.fetch_sub(1, std::memory_order_relaxed);
+
+		size_t hole = indx;
+
+		for (size_t next = hole + 1; next < indx + SampleCount && m_samples[next % SampleCount].m_umem; next++)
+		{
+			size_t home = hash(m_samples[next % SampleCount].m_umem) >> 16;
+
+			// the entry moves to the hole unless its home lies after the hole
+			if (((next - home) % SampleCount) >= ((next - hole) % SampleCount))
+			{
+				m_samples[hole % SampleCount] = m_samples[next % SampleCount];
+				hole = next;
+			}
+		}
+
+		m_samples[hole % SampleCount].m_umem = NULL;
+	}
+
+	m_stack* find_stack(size_t code, void** frames, size_t depth)
+	{
+		for (size_t i = 0; i < StackCount; i++)
+		{
+			m_stack* stack = &m_stacks[(code + i) % StackCount];
+
+			if (!stack->m_hash)
+			{
+				stack->m_hash  = code;
+				stack->m_depth = depth;
+
+				for (size_t j = 0; j < depth; j++)
+					stack->m_frames[j] = frames[j];
+
+				return stack;
+			}
+
+			if (stack->m_hash == code && stack->m_depth == depth)
+			{
+				size_t j = 0;
+				while (j < depth && stack->m_frames[j] == frames[j])
+					j++;
+
+				if (j == depth)
+					return stack;
+			}
+		}
+
+		return NULL;
+	}
+
+	// writes the profile in the legacy text format of pprof (heap_v2): the in use
+	// and the total sampled counts of every stack, then the mappings of the
+	// process, so that pprof symbolizes the frames. The samples dropped since
+	// the tables were full are written as a comment, which pprof skips
+	bool dump(FILE* file)
+	{
+		SCOPE_LOCK(m_lock);
+
+		size_t inuse = 0, inusebytes = 0, allocs = 0, allocbytes = 0;
+
+		for (size_t i = 0; i < StackCount; i++)
+		{
+			inuse      += m_stacks[i].m_inuse;
+			inusebytes += m_stacks[i].m_inusebytes;
+			allocs     += m_stacks[i].m_allocs;
+			allocbytes += m_stacks[i].m_allocbytes;
+		}
+
+		fprintf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", inuse, inusebytes, allocs, allocbytes, m_rate);
+
+		for (size_t i = 0; i < StackCount; i++)
+		{
+			m_stack* stack = &m_stacks[i];
+			if (!stack->m_hash)
+				continue;
+
+			fprintf(file, "%zu: %zu [%zu: %zu] @", stack->m_inuse, stack->m_inusebytes, stack->m_allocs, stack->m_allocbytes);
+
+			for (size_t j = 0; j < stack->m_depth; j++)
+				fprintf(file, " %p", stack->m_frames[j]);
+
+			fprintf(file, "\n");
+		}
+
+		if (m_dropped)
+			fprintf(file, "# %zu samples dropped, the tables of the profile were full\n", m_dropped);
+
+		fprintf(file, "\nMAPPED_LIBRARIES:\n");
+
+#if defined(__linux__)
+		FILE* maps = fopen("/proc/self/maps", "r");
+
+		if (maps)
+		{
+			char   line[0x400];
+			size_t size;
+
+			while ((size = fread(line, 1, sizeof(line), maps)) > 0)
+				fwrite(line, 1, size, file);
+
+			fclose(maps);
+		}
+#endif
+
+		return ferror(file) == 0;
+	}
+
+	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_heap_profile);
+};
@@ -2,7 +2,10 @@
 //
 // externals:
 
+#include <string.h>
+
 #include "large_block_allocator.hpp"
+#include "page_provider.hpp"
 
 
 //===================================================================================
@@ -126,6 +129,11 @@ namespace Large
 			return reinterpret_cast<char*>(this) + sizeof(m_ctrl_block);
 		}
 
+		INLINE size_t user_size()
+		{
+			return size() - sizeof(m_ctrl_block);
+		}
+
 		DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_ctrl_block);
 	};
 
@@ -158,6 +166,7 @@ namespace Large
 		};
 
 		LOCK         m_lock; // mutex to lock the whole pool
+		size_t       m_size; // size of the memory region owned by the pool
 		p_ctrl_block m_foot; // free control memory block which is used to allocate new memory blocks
 
 		uint32_t     m_bits; // binary map used to indicate what bins are in the use
@@ -168,8 +177,9 @@ namespace Large
 
 		INLINE void init(size_t foot_size)
 		{
+			m_size = foot_size;
 			m_bits = 0;
-			m_lock.mutex::mutex();
+			new (&m_lock) LOCK();
 
 			m_foot = add_mem<p_ctrl_block>(this, sizeof(m_pool_local));
 			m_foot->size(foot_size - sizeof(m_pool_local));
@@ -187,6 +197,10 @@ namespace Large
 		// from the foots
 		void* malloc(size_t bytesreq)
 		{
+			// the request is too large to round up to a block
+			if (bytesreq > (size_t)0 - sizeof(m_ctrl_block) - 0x7)
+				return VOID_1;
+
 			if (!m_lock.try_lock())
 				return VOID_0;
 
@@ -195,11 +209,12 @@ namespace Large
 			size_t size = (bytesreq + sizeof(m_ctrl_block) + 0x7) & ~0x7; //adjusting the size to double word boundary
 			size_t indx = bins_indx(size);
 
-			if ((m_bits >> indx) & 1u)
+			if (m_bits >> indx)
 			{
 				mem = bins_malloc(size);
 			}
-			else if (size < m_foot->size())
+
+			if (mem == NULL && size + sizeof(m_ctrl_block) <= m_foot->size())
 			{
 				mem = foot_malloc(size);
 			}
@@ -208,15 +223,35 @@ namespace Large
 			return (mem != NULL) ? mem : VOID_1;
 		}
 
+		// this routine releases allocated memory block
+		void free(void* p)
+		{
+			SCOPE_LOCK(m_lock);
+
+			blck_free(mem_to_blk(p));
+		}
+
+		// resizes the block in place, returns NULL if it has to be moved
+		void* realloc(void* p, size_t bytesreq)
+		{
+			// the request is too large to round up to a block, which would
+			// wrap around to a small size and shrink the block
+			if (bytesreq > (size_t)0 - sizeof(m_ctrl_block) - 0x7)
+				return NULL;
+
+			SCOPE_LOCK(m_lock);
+
+			size_t size = (bytesreq + sizeof(m_ctrl_block) + 0x7) & ~0x7; //adjusting the size to double word boundary
+
+			return blck_resize(mem_to_blk(p), size) ? p : NULL;
+		}
+
 		// this routine releases allocated memory block; it tries to coalesce
 		// it with the previous or the next block, and then caches the result
 		// in the binary map
-		void free(void* p)
+		INLINE void blck_free(p_ctrl_block curr_b)
 		{
-			SCOPE_LOCK(m_lock);		
-
-			p_ctrl_block curr_b = mem_to_blk(p);
-			size_t       curr_s = curr_b->size();
+			size_t curr_s = curr_b->size();
 
 			assert(curr_b->pool() == this);
 
@@ -264,30 +299,153 @@ namespace Large
 			push_binblk(curr_b);
 		}
 
-		// tries to find the most suitable memory block in the
-		// specified binary tree
+		// this routine resizes the block in place: it is grown into the next
+		// block if that one is free or is the foot, and the tail of the block
+		// is split off and freed unless it is too small to hold a block
+		INLINE bool blck_resize(p_ctrl_block curr_b, size_t size)
+		{
+			size_t curr_s = curr_b->size();
+
+			assert(curr_b->pool() == this);
+
+			if (size > curr_s)
+			{
+				p_ctrl_block next_b = curr_b->next_blck();
+				size_t       next_s = next_b->size();
+
+				if (next_b->cbit())
+					return false;
+
+				// the foot keeps room for its header
+				if (next_b == m_foot)
+				{
+					if (curr_s + next_s < size + sizeof(m_ctrl_block))
+						return false;
+
+					curr_b->size(size);
+
+					m_foot = curr_b->next_blck();
+					m_foot->size(curr_s + next_s - size);
+					m_foot->head(size);
+					m_foot->turn(PBit);
+					m_foot->drop(CBit);
+
+					return true;
+				}
+
+				if (curr_s + next_s < size)
+					return false;
+
+				pull_binblk(next_b);
+
+				curr_s += next_s;
+
+				curr_b->size(curr_s);
+				curr_b->next_blck()->turn(PBit);
+			}
+
+			blck_split(curr_b, size);
+			return true;
+		}
+
+		// the tail of the block is freed as an allocated block,
+		// so that it is coalesced with the next one if that is free
+		INLINE void blck_split(p_ctrl_block blck, size_t size)
+		{
+			size_t rest = blck->size() - size;
+
+			if (rest >= sizeof(m_ctrl_block))
+			{
+				blck->size(size);
+
+				p_ctrl_block tail = blck->next_blck();
+				tail->m_data = CBit | PBit;
+				tail->size(rest);
+				tail->pool(this);
+
+				blck_free(tail);
+			}
+		}
+
+		// tries to find the most suitable memory block in the binary
+		// trees: the smallest one which is not smaller than the requested
+		// size; the tree of the requested size is looked through first,
+		// then the next larger non empty one
 		INLINE void* bins_malloc(size_t size)
 		{
-			p_ctrl_block topt = bins_blck(bins_indx(size));
-			p_ctrl_block blck = topt;
+			size_t indx = bins_indx(size);
+
+			p_ctrl_block topt = NULL;
+			p_ctrl_block blck = NULL;
+			p_ctrl_block rest = NULL; // the deepest right subtree not taken on the way down
+
+			size_t rsize = (size_t)0 - size; // blocks smaller than the request never fit
 
-			size_t rsize = topt->size() - size;
+			size_t H = sizeof(size_t) * 8 - 1;
+			size_t R = size << (H - indx);
 
-			while (topt = topt->left_most_limb())
+			// walk down along the path of the requested size
+			for (topt = ((m_bits >> indx) & 1u) ? bins_blck(indx) : NULL; topt; )
 			{
 				size_t srem = topt->size() - size;
 				if (srem < rsize)
 				{
 					rsize = srem;
 					blck = topt;
+
+					if (rsize == 0)
+						break;
+				}
+
+				R <<= 1;
+
+				p_ctrl_block rght = topt->m_limb[1];
+				topt = topt->m_limb[(R >> H) & 1u];
+
+				if (rght && rght != topt)
+					rest = rght;
+
+				if (!topt)
+				{
+					topt = rest; // holds the sizes next to the requested one
+					break;
 				}
 			}
 
+			// nothing fits in the tree of the requested size,
+			// take the least non empty tree above it
+			if (!blck && !topt)
+			{
+				size_t bits = m_bits & ~(((size_t)2 << indx) - 1);
+
+				unsigned long next;
+				if (BSF(&next, bits))
+					topt = bins_blck(next);
+			}
+
+			// the smallest block of the subtree is on its left most path
+			while (rsize && topt)
+			{
+				size_t srem = topt->size() - size;
+				if (srem < rsize)
+				{
+					rsize = srem;
+					blck = topt;
+				}
+
+				topt = topt->left_most_limb();
+			}
+
+			if (!blck)
+				return NULL;
+
 			pull_binblk(blck);
 
 			blck->pool(this);
 			blck->turn(CBit);
-			blck->turn(PBit);
+			blck->next_blck()->turn(PBit);
+
+			blck_split(blck, size);
 
 			return blck->user_blck();
 		}
@@ -320,7 +478,7 @@ namespace Large
 		// the index in the array of trees is the most significant bit of the size
 		INLINE size_t bins_indx(size_t size)
 		{
-			DWORD indx;
+			unsigned long indx;
 			BSR(&indx, size);
 
 			return indx;
@@ -353,15 +511,18 @@ namespace Large
 
 			p_ctrl_block topt = bins_blck(indx);
 
+			// the bits of the size below the most significant one select the
+			// path in the tree, starting from the highest
+			size_t H = sizeof(size_t) * 8 - 1;
+			size_t R = size << (H - indx);
+
 			for (;;)
 			{
-				size_t H = (size_t)1u << 31u;
-				size_t R = size << (31u - indx);
+				R <<= 1;
 
 				if (topt->size() != size)
 				{
-					p_ctrl_block* c = &topt->m_limb[R & H];
-					R <<= 1;
+					p_ctrl_block* c = &topt->m_limb[(R >> H) & 1u];
 
 					if (*c)
 					{
@@ -455,12 +616,12 @@ namespace Large
 					p_ctrl_block cld0, cld1;
 					temp->m_parent = prnt;
 
-					if (cld0 = blck->m_limb[0])
+					if ((cld0 = blck->m_limb[0]))
 					{
 						temp->m_limb[0] = cld0;
 						cld0->m_parent  = temp;
 					}
-					if (cld1 = blck->m_limb[1])
+					if ((cld1 = blck->m_limb[1]))
 					{
 						temp->m_limb[1] = cld1;
 						cld1->m_parent  = temp;
@@ -564,22 +725,51 @@ void BlockAllocator::free(void* umem)
 
 /////////////////////////////////////////////////////////////////////////////////////
 
+void* BlockAllocator::realloc(void* umem, size_t size)
+{
+	if (!umem)
+		return malloc(size);
+
+	if (!size)
+	{
+		free(umem);
+		return NULL;
+	}
+
+	p_ctrl_block blck = mem_to_blk(umem);
+	p_pool_local pool = blck->pool();
+
+	// the block is resized in place if its neighbours allow,
+	// otherwise it is moved to a new block
+	void* mem = pool->realloc(umem, size);
+	if (mem)
+		return mem;
+
+	mem = malloc(size);
+	if (mem)
+	{
+		size_t used = blck->user_size();
+		memcpy(mem, umem, (used < size) ? used : size);
+
+		free(umem);
+	}
+
+	return mem;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
 p_pool_local BlockAllocator::pool_construct(size_t capacity)
 {
 	p_pool_local pool = NULL;
 
-	SYSTEM_INFO info;
-	::GetSystemInfo(&info);
-
-	size_t gran = info.dwAllocationGranularity;
+	size_t gran = page_granularity();
 	size_t size = (capacity + (gran << 1) - 1) & ~(gran - 1); // align capacity to granularity size
 
-	void* memory = ::VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	void* memory = page_alloc(size);
 	if (!memory)
 		return NULL;
 
-	::ZeroMemory(memory, size);
-
 	pool = static_cast<p_pool_local>(memory);
 	pool->init(size);
 
@@ -593,11 +783,11 @@ void BlockAllocator::pool_destruct(p_pool_local pool)
 	if (pool)
 	{
 		pool->fini();
-		::VirtualFree(pool, 0, MEM_RELEASE);
+		page_free(pool, pool->m_size);
 	}
 }	
 
-uint16_t BlockAllocator::m_ThreadIndex = (uint16_t)-1;
+THREAD_LOCAL_DEF(uint16_t) BlockAllocator::m_ThreadIndex = (uint16_t)-1;
 
 };
 
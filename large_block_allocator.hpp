@@ -24,6 +24,8 @@ public:
 	void* malloc(size_t size);
 	void  free(void* umem);
 
+	void* realloc(void* umem, size_t size);
+
 private:
 	enum
 	{
@@ -1,5 +1,5 @@
 //===================================================================================
-// 
+//
 // Just finished what i haven't caught up to do in the previous version:
 // united SmallBlockAllocator and LargeBlockAllocator to one
 // BlockAllocator class to manage effectively small and large memory blocks in
@@ -11,73 +11,1124 @@
 // m_ctrl_block - which acts as a "service" header for user allocated block of memory; and
 // m_pool_local - structure which acts as thread local memory pool and manages (allocates and caches)
 // requested memory blocks; m_ctrl_pool uses two binary map inside to cache already freed memory block
-// for future use: 1) array of linked lists to cache small size memory blocks (<256 bytes) and 
-// 2) array of binary trees to cache large size memory block (>256 bytes); 
+// for future use: 1) array of linked lists to cache small size memory blocks (<256 bytes) and
+// 2) array of binary trees to cache large size memory block (>256 bytes);
 // Also when freeing an already allocated memory block, first trying to coalesce it with the
 // neighboring memory block if they are free and only cache it to treemap or listmap (depending on size of the block).
 //
 //
 //===================================================================================
 //
+// The benchmark runs every workload against every allocator and prints a
+// row per pair: the throughput in millions of calls per second, the latency
+// percentiles of the calls and the peak of the resident memory over the run.
+//
+//   malloc [threads] [scale]
+//   malloc replay <trace> [threaded]
+//
+// threads is the number of the threads of the multithreaded workloads (the
+// hardware threads, 2 to 8, by default); scale multiplies the calls done by
+// each workload (1 by default). Every 16th call is timed, the latencies
+// include the cost of reading the clock. The resident memory is sampled by
+// a thread of its own every millisecond and reported above the one the run
+// starts with; the system malloc and nedmalloc keep the memory of the
+// previous runs, so theirs is understated. An allocator is skipped by the
+// workloads requesting more than it serves (SmallBlockAllocator serves the
+// requests below 256 bytes only); the calls which fail are counted.
+//
+// The replay runs the calls of a trace recorded by BlockAllocator::trace_start
+// against every allocator, in the order they were recorded. By default all
+// the calls are made by one thread; threaded makes the calls of every thread
+// of the trace by a thread of its own (the threads of the trace are folded
+// onto 8), which waits for the calls before them to be made by the others.
+// The blocks are numbered as the trace is read, so the replay does not depend
+// on the addresses; the calls on the blocks allocated before the trace started
+// are left out, the blocks still in use at the end of the trace are freed
+// after the measurement. aligned_malloc is replayed by malloc, since the
+// other allocators lack it.
 //
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <unordered_map>
 
 #include "block_allocator.hpp"
+#include "small_block_allocator.hpp"
+#include "large_block_allocator.hpp"
+#include "trace_recorder.hpp"
 
+// nedmalloc.c is built in the release configuration only
+#ifndef BENCH_NEDMALLOC
+#if defined(NDEBUG)
+#define BENCH_NEDMALLOC 1
+#else
+#define BENCH_NEDMALLOC 0
+#endif
+#endif
 
-/////////////////////////////////////////////////////////////////////////////////////
-void main()
+#if BENCH_NEDMALLOC
+#define NO_NED_NAMESPACE
+#include "nedmalloc.h"
+#endif
+
+#if defined(_WIN32)
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+//===================================================================================
+//
+// allocators:
+
+// the allocators are called through this interface, so each of them pays
+// the same virtual call per request
+struct Heap
+{
+	virtual ~Heap() {}
+
+	virtual void* malloc(size_t size) = 0;
+	virtual void  free(void* umem) = 0;
+	virtual void* realloc(void* umem, size_t size) = 0;
+};
+
+template <typename Allocator>
+struct AllocatorHeap : public Heap
+{
+	Allocator m_Allocator;
+
+	AllocatorHeap(size_t capacity) : m_Allocator(capacity) {}
+
+	void* malloc(size_t size) override             { return m_Allocator.malloc(size); }
+	void  free(void* umem) override                { m_Allocator.free(umem); }
+	void* realloc(void* umem, size_t size) override { return m_Allocator.realloc(umem, size); }
+};
+
+struct SystemHeap : public Heap
+{
+	void* malloc(size_t size) override             { return ::malloc(size); }
+	void  free(void* umem) override                { ::free(umem); }
+	void* realloc(void* umem, size_t size) override { return ::realloc(umem, size); }
+};
+
+#if BENCH_NEDMALLOC
+struct NedHeap : public Heap
+{
+	void* malloc(size_t size) override             { return ::nedmalloc(size); }
+	void  free(void* umem) override                { ::nedfree(umem); }
+	void* realloc(void* umem, size_t size) override { return ::nedrealloc(umem, size); }
+};
+#endif
+
+enum
+{
+	// the pools of SmallBlockAllocator and LargeBlockAllocator do not grow,
+	// there are 16 of them; BlockAllocator grows its pools by itself
+	FixedPoolCapacity = 0x1000000
+};
+
+struct HeapInfo
+{
+	const char* m_Name;
+	size_t      m_MaxSize; // the largest request the allocator serves
+};
+
+static const HeapInfo g_Heaps[] =
+{
+	{ "BlockAllocator",      (size_t)-1 },
+	{ "SmallBlockAllocator", 255 },
+	{ "LargeBlockAllocator", (size_t)-1 },
+	{ "system malloc",       (size_t)-1 },
+#if BENCH_NEDMALLOC
+	{ "nedmalloc",           (size_t)-1 },
+#endif
+};
+
+
+//===================================================================================
+//
+// measurement:
+
+// the resident memory of the process in bytes, 0 if it is not known
+static size_t resident_size()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.WorkingSetSize;
+
+	return 0;
+#elif defined(__linux__)
+	// read without stdio, so that the sampling does not use the system malloc
+	char buffer[0x100];
+	int  file = open("/proc/self/statm", O_RDONLY);
+
+	if (file < 0)
+		return 0;
+
+	ssize_t done = read(file, buffer, sizeof(buffer) - 1);
+	close(file);
+
+	if (done <= 0)
+		return 0;
+
+	buffer[done] = 0;
+
+	size_t pages = 0, resident = 0;
+	if (sscanf(buffer, "%zu %zu", &pages, &resident) != 2)
+		return 0;
+
+	return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+	return 0;
+#endif
+}
+
+// samples the resident memory every millisecond until it is stopped
+struct ResidentSampler
+{
+	ATOMIC_VALUE(bool)   m_Stop;
+	ATOMIC_VALUE(size_t) m_Peak;
+	std::thread          m_Thread;
+
+	ResidentSampler() : m_Stop(false), m_Peak(resident_size())
+	{
+		m_Thread = std::thread([this]()
+		{
+			while (!m_Stop.load(std::memory_order_acquire))
+			{
+				size_t size = resident_size();
+				if (size > m_Peak.load(std::memory_order_relaxed))
+					m_Peak.store(size, std::memory_order_relaxed);
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+	}
+
+	size_t stop()
+	{
+		m_Stop.store(true, std::memory_order_release);
+		m_Thread.join();
+
+		size_t size = resident_size();
+		return (size > m_Peak.load()) ? size : m_Peak.load();
+	}
+};
+
+INLINE static uint64_t clock_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the threads of a workload wait for each other at the barrier; the waiting
+// threads yield, since there may be fewer cores than threads
+struct Barrier
+{
+	size_t               m_Threads;
+	ATOMIC_VALUE(size_t) m_Count;
+	ATOMIC_VALUE(size_t) m_Phase;
+
+	Barrier(size_t threads) : m_Threads(threads), m_Count(0), m_Phase(0) {}
+
+	void wait()
+	{
+		size_t phase = m_Phase.load(std::memory_order_acquire);
+
+		if (m_Count.fetch_add(1, std::memory_order_acq_rel) + 1 == m_Threads)
+		{
+			m_Count.store(0, std::memory_order_relaxed);
+			m_Phase.fetch_add(1, std::memory_order_release);
+			return;
+		}
+
+		while (m_Phase.load(std::memory_order_acquire) == phase)
+			std::this_thread::yield();
+	}
+};
+
+// the state of a thread of a workload: it counts the calls it makes to the
+// allocator and times every LatencyStride-th of them
+struct Worker
 {
 	enum
 	{
-		ThreadCount = 1
+		LatencyStride = 16
 	};
 
-	BlockAllocator allocator;
+	Heap*    m_Heap;
+	uint64_t m_Seed;
+	size_t   m_Calls;
+	size_t   m_Fails;
+	uint64_t m_Begin;
+	uint64_t m_End;
+	size_t   m_Measured; // calls between start and stop
+	size_t   m_Timed;    // latencies taken between start and stop
+
+	std::vector<uint32_t> m_Latency; // reserved before the run, so it never allocates meanwhile
+
+	void init(Heap* heap, size_t indx, size_t calls)
+	{
+		m_Heap  = heap;
+		m_Seed  = 0x9E3779B97F4A7C15ull * (indx + 1);
+		m_Calls = 0;
+		m_Fails = 0;
+		m_Begin = 0;
+		m_End   = 0;
+
+		m_Measured = 0;
+		m_Timed    = 0;
+
+		m_Latency.clear();
+		m_Latency.reserve(calls / LatencyStride + 1);
+	}
+
+	INLINE uint32_t random()
+	{
+		m_Seed ^= m_Seed << 13;
+		m_Seed ^= m_Seed >> 7;
+		m_Seed ^= m_Seed << 17;
+
+		return static_cast<uint32_t>(m_Seed >> 32);
+	}
+
+	// a size between min and max, the power of two of which is uniform
+	INLINE size_t random_size(size_t min, size_t max)
+	{
+		unsigned long low, high;
+		BSR(&low, min);
+		BSR(&high, max);
+
+		size_t base = (size_t)1 << (low + random() % (high - low + 1));
+		size_t size = base + random() % base;
+
+		return (size < min) ? min : (size > max) ? max : size;
+	}
+
+	INLINE bool timed()
+	{
+		m_Calls += 1;
+		return (m_Calls % LatencyStride) == 0 && m_Latency.size() < m_Latency.capacity();
+	}
+
+	INLINE void timed(uint64_t begin)
+	{
+		uint64_t span = clock_ns() - begin;
+		m_Latency.push_back((span < 0xFFFFFFFFu) ? static_cast<uint32_t>(span) : 0xFFFFFFFFu);
+	}
 
-	std::thread thread[ThreadCount];
-	for (size_t i = 0; i < ThreadCount; i++)
+	// the first and the last byte of a block are written, so that the
+	// resident memory follows the blocks allocated
+	INLINE void* malloc(size_t size)
 	{
-		thread[i] = std::thread([&]()
+		void* umem;
+
+		if (timed())
+		{
+			uint64_t begin = clock_ns();
+			umem = m_Heap->malloc(size);
+			timed(begin);
+		}
+		else
 		{
-			std::this_thread::sleep_for(std::chrono::milliseconds(ThreadCount * 10 - i * 10));
+			umem = m_Heap->malloc(size);
+		}
 
-			for (size_t i = 0; i < 10000; i++)
+		if (umem && size)
+		{
+			static_cast<char*>(umem)[0] = 1;
+			static_cast<char*>(umem)[size - 1] = 1;
+		}
+		else if (size)
+		{
+			m_Fails += 1;
+		}
+
+		return umem;
+	}
+
+	INLINE void free(void* umem)
+	{
+		if (!umem)
+			return;
+
+		if (timed())
+		{
+			uint64_t begin = clock_ns();
+			m_Heap->free(umem);
+			timed(begin);
+		}
+		else
+		{
+			m_Heap->free(umem);
+		}
+	}
+
+	INLINE void* realloc(void* umem, size_t size)
+	{
+		void* mem;
+
+		if (timed())
+		{
+			uint64_t begin = clock_ns();
+			mem = m_Heap->realloc(umem, size);
+			timed(begin);
+		}
+		else
+		{
+			mem = m_Heap->realloc(umem, size);
+		}
+
+		if (mem)
+		{
+			static_cast<char*>(mem)[size - 1] = 1;
+		}
+		else
+		{
+			m_Fails += 1;
+		}
+
+		return mem;
+	}
+
+	// the calls made before start are not measured
+	INLINE void start()
+	{
+		m_Calls = 0;
+		m_Latency.clear();
+
+		m_Begin = clock_ns();
+	}
+
+	INLINE void stop()
+	{
+		m_End = clock_ns();
+
+		m_Measured = m_Calls;
+		m_Timed    = m_Latency.size();
+	}
+};
+
+
+//===================================================================================
+//
+// workloads:
+
+struct Workload
+{
+	const char* m_Name;
+	size_t      m_MaxSize; // the largest request of the workload
+	bool        m_Threaded;
+	size_t      m_Calls;   // calls done by each thread, roughly, at the scale of 1
+
+	// runs the workload by the workers; every worker calls start and stop
+	// around the part measured and frees its blocks afterwards
+	void (*m_Run)(std::vector<Worker>& workers, size_t scale);
+};
+
+// a single thread allocates a few blocks of the small sizes and frees them
+static void run_ping_pong(std::vector<Worker>& workers, size_t scale)
+{
+	Worker& worker = workers[0];
+
+	void*  umem[8];
+	size_t loop = 0x20000 * scale;
+
+	worker.start();
+
+	for (size_t i = 0; i < loop; i++)
+	{
+		for (size_t j = 0; j < 8; j++)
+			umem[j] = worker.malloc(16 + j * 16);
+
+		for (size_t j = 0; j < 8; j++)
+			worker.free(umem[j]);
+	}
+
+	worker.stop();
+}
+
+// the server churn of Larson and Krishnan: every thread replaces random
+// blocks of its array by blocks of random sizes; between the rounds the
+// arrays are passed on to the next thread, which frees the blocks
+// allocated by the previous one
+static void run_larson(std::vector<Worker>& workers, size_t scale)
+{
+	enum
+	{
+		Slots  = 0x400,
+		Rounds = 8
+	};
+
+	size_t  count = workers.size();
+	size_t  loop  = 0x8000 * scale;
+	Barrier barrier(count);
+
+	std::vector<void*> slots(count * Slots, NULL);
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < count; t++)
+	{
+		threads.push_back(std::thread([&, t]()
+		{
+			Worker& worker = workers[t];
+
+			for (size_t i = 0; i < Slots; i++)
+				slots[t * Slots + i] = worker.malloc(worker.random_size(16, 255));
+
+			barrier.wait();
+			worker.start();
+
+			for (size_t r = 0; r < Rounds; r++)
 			{
-				void* p0 = allocator.malloc((1 << 7) + 4 * 0);
-				void* p00 = allocator.malloc(1);
-				void* p1 = allocator.malloc((1 << 7) + 4 * 1);
-				void* p10 = allocator.malloc(1);
-				void* p2 = allocator.malloc((1 << 7) + 4 * 2);
-				void* p20 = allocator.malloc(1);
-				void* p3 = allocator.malloc((1 << 7) + 4 * 3);
-				void* p30 = allocator.malloc(1);
-
-				allocator.free(p0);
-				allocator.free(p1);
-				allocator.free(p2);
-				allocator.free(p3);
-
-				p0 = allocator.malloc(17);
-				p1 = allocator.malloc(18);
-				p2 = allocator.malloc(19);
-				p3 = allocator.malloc(20);
-
-				allocator.free(p0);
-				allocator.free(p1);
-				allocator.free(p2);
-				allocator.free(p3);
-
-				allocator.free(p00);
-				allocator.free(p10);
-				allocator.free(p20);
-				allocator.free(p30);
+				void** array = &slots[((t + r) % count) * Slots];
+
+				for (size_t i = 0; i < loop / Rounds; i++)
+				{
+					size_t indx = worker.random() % Slots;
+
+					worker.free(array[indx]);
+					array[indx] = worker.malloc(worker.random_size(16, 255));
+				}
+
+				barrier.wait();
 			}
-		});
+
+			worker.stop();
+
+			for (size_t i = 0; i < Slots; i++)
+				worker.free(slots[t * Slots + i]);
+		}));
 	}
-	for (size_t i = 0; i < ThreadCount; i++)
+
+	for (size_t t = 0; t < count; t++)
+		threads[t].join();
+}
+
+// the threads are paired: the producer allocates the blocks and passes them
+// through a ring to the consumer, which frees them
+static void run_producer_consumer(std::vector<Worker>& workers, size_t scale)
+{
+	enum
+	{
+		RingSize = 0x400
+	};
+
+	// the ends of the ring are padded apart, since the producer writes
+	// the head and the consumer writes the tail
+	struct Ring
+	{
+		ATOMIC_VALUE(size_t) m_Head;
+		char m_HeadPad[CACHE_LINE - sizeof(ATOMIC_VALUE(size_t))];
+		ATOMIC_VALUE(size_t) m_Tail;
+		char m_TailPad[CACHE_LINE - sizeof(ATOMIC_VALUE(size_t))];
+		void* m_Items[RingSize];
+	};
+
+	size_t pairs = workers.size() / 2;
+	size_t loop  = 0x40000 * scale;
+
+	std::vector<Ring> rings(pairs);
+	std::vector<std::thread> threads;
+
+	for (size_t p = 0; p < pairs; p++)
 	{
-		thread[i].join();
+		rings[p].m_Head.store(0);
+		rings[p].m_Tail.store(0);
+
+		threads.push_back(std::thread([&, p]()
+		{
+			Worker& worker = workers[2 * p];
+			Ring&   ring   = rings[p];
+
+			worker.start();
+
+			for (size_t i = 0; i < loop; i++)
+			{
+				void* umem = worker.malloc(worker.random_size(16, 255));
+
+				size_t head = ring.m_Head.load(std::memory_order_relaxed);
+				while (head - ring.m_Tail.load(std::memory_order_acquire) == RingSize)
+					std::this_thread::yield();
+
+				ring.m_Items[head % RingSize] = umem;
+				ring.m_Head.store(head + 1, std::memory_order_release);
+			}
+
+			worker.stop();
+		}));
+
+		threads.push_back(std::thread([&, p]()
+		{
+			Worker& worker = workers[2 * p + 1];
+			Ring&   ring   = rings[p];
+
+			worker.start();
+
+			for (size_t i = 0; i < loop; i++)
+			{
+				size_t tail = ring.m_Tail.load(std::memory_order_relaxed);
+				while (ring.m_Head.load(std::memory_order_acquire) == tail)
+					std::this_thread::yield();
+
+				void* umem = ring.m_Items[tail % RingSize];
+				ring.m_Tail.store(tail + 1, std::memory_order_release);
+
+				worker.free(umem);
+			}
+
+			worker.stop();
+		}));
 	}
-}
\ No newline at end of file
+
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
+
+// every thread keeps a set of blocks of the sizes uniform by the powers of
+// two up to 32 KB; a random slot is freed if it holds a block, otherwise it
+// is filled
+static void run_random_sizes(std::vector<Worker>& workers, size_t scale)
+{
+	enum
+	{
+		Slots = 0x400
+	};
+
+	size_t  count = workers.size();
+	size_t  loop  = 0x20000 * scale;
+	Barrier barrier(count);
+
+	std::vector<void*> slots(count * Slots, NULL);
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < count; t++)
+	{
+		threads.push_back(std::thread([&, t]()
+		{
+			Worker& worker = workers[t];
+			void**  array  = &slots[t * Slots];
+
+			barrier.wait();
+			worker.start();
+
+			for (size_t i = 0; i < loop; i++)
+			{
+				size_t indx = worker.random() % Slots;
+
+				if (array[indx])
+				{
+					worker.free(array[indx]);
+					array[indx] = NULL;
+				}
+				else
+				{
+					array[indx] = worker.malloc(worker.random_size(8, 0x8000));
+				}
+			}
+
+			worker.stop();
+
+			for (size_t i = 0; i < Slots; i++)
+				worker.free(array[i]);
+		}));
+	}
+
+	for (size_t t = 0; t < count; t++)
+		threads[t].join();
+}
+
+// every thread grows a few buffers side by side, by a half of their size at a
+// time from 16 bytes to 64 KB, the way the dynamic arrays and strings grow
+static void run_realloc_growth(std::vector<Worker>& workers, size_t scale)
+{
+	enum
+	{
+		Buffers = 4,
+		MinSize = 0x10,
+		MaxSize = 0x10000
+	};
+
+	size_t  count = workers.size();
+	size_t  loop  = 0x2000 * scale;
+	Barrier barrier(count);
+
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < count; t++)
+	{
+		threads.push_back(std::thread([&, t]()
+		{
+			Worker& worker = workers[t];
+
+			void*  umem[Buffers];
+			size_t size[Buffers];
+
+			barrier.wait();
+			worker.start();
+
+			for (size_t i = 0; i < loop; i++)
+			{
+				for (size_t j = 0; j < Buffers; j++)
+				{
+					size[j] = MinSize + worker.random() % MinSize;
+					umem[j] = worker.malloc(size[j]);
+				}
+
+				for (bool grown = true; grown; )
+				{
+					grown = false;
+
+					for (size_t j = 0; j < Buffers; j++)
+					{
+						if (!umem[j] || size[j] >= MaxSize)
+							continue;
+
+						size_t next = size[j] + size[j] / 2;
+						void*  mem  = worker.realloc(umem[j], next);
+
+						if (mem)
+						{
+							umem[j] = mem;
+							size[j] = next;
+							grown   = true;
+						}
+					}
+				}
+
+				for (size_t j = 0; j < Buffers; j++)
+					worker.free(umem[j]);
+			}
+
+			worker.stop();
+		}));
+	}
+
+	for (size_t t = 0; t < count; t++)
+		threads[t].join();
+}
+
+static const Workload g_Workloads[] =
+{
+	{ "ping-pong",         0x90,    false, 0x200000, run_ping_pong },
+	{ "larson",            0xFF,    true,  0x10000,  run_larson },
+	{ "producer-consumer", 0xFF,    true,  0x40000,  run_producer_consumer },
+	{ "random-sizes",      0x8000,  true,  0x20000,  run_random_sizes },
+	{ "realloc-growth",    0x18000, true,  0xC0000,  run_realloc_growth }
+};
+
+
+//===================================================================================
+//
+// replay:
+
+// a call of the trace; the blocks are numbered by the slots of the replay
+struct ReplayCall
+{
+	uint32_t m_Op;     // the op of the record, see m_trace_record
+	uint32_t m_Worker; // the worker making the call
+	size_t   m_Size;
+	size_t   m_Slot;   // the block allocated, resized or freed
+};
+
+struct Replay
+{
+	enum
+	{
+		MaxWorkers = 8
+	};
+
+	std::vector<ReplayCall> m_Calls;
+	size_t m_Slots;   // blocks allocated over the trace
+	size_t m_Workers; // workers making the calls
+	size_t m_MaxSize; // the largest request
+	size_t m_Skipped; // calls on the blocks allocated before the trace started
+	bool   m_Merged;  // whether the trace ran out of the thread numbers, so some threads share one
+};
+
+static Replay g_Replay;
+
+// reads the trace into g_Replay; the records of a thread are given to the
+// worker of the order the thread was seen in, if threaded
+static bool replay_load(const char* path, bool threaded)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	m_trace_header header;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || !header.valid())
+	{
+		fclose(file);
+		return false;
+	}
+
+	std::unordered_map<uint64_t, size_t>   blocks;  // the slots of the live blocks by their addresses
+	std::unordered_map<uint32_t, uint32_t> workers; // the workers by the threads of the trace
+
+	g_Replay.m_Calls.clear();
+	g_Replay.m_Slots   = 0;
+	g_Replay.m_Workers = 1;
+	g_Replay.m_MaxSize = 0;
+	g_Replay.m_Skipped = 0;
+	g_Replay.m_Merged  = false;
+
+	m_trace_record record;
+
+	while (fread(&record, sizeof(record), 1, file) == 1)
+	{
+		ReplayCall call;
+
+		call.m_Op     = static_cast<uint32_t>(record.m_op);
+		call.m_Worker = 0;
+		call.m_Size   = static_cast<size_t>(record.m_size);
+		call.m_Slot   = 0;
+
+		if (record.m_thread == m_trace_record::MaxThread)
+			g_Replay.m_Merged = true;
+
+		if (threaded)
+		{
+			uint32_t thread = static_cast<uint32_t>(record.m_thread);
+
+			if (workers.find(thread) == workers.end())
+			{
+				uint32_t count = static_cast<uint32_t>(workers.size());
+				workers[thread] = count % Replay::MaxWorkers;
+			}
+
+			call.m_Worker = workers[thread];
+		}
+
+		switch (call.m_Op)
+		{
+		case m_trace_record::Malloc:
+		case m_trace_record::AlignedMalloc:
+		{
+			if (!record.m_addr)
+				continue;
+
+			call.m_Op   = m_trace_record::Malloc;
+			call.m_Slot = g_Replay.m_Slots++;
+
+			blocks[record.m_addr] = call.m_Slot;
+			break;
+		}
+		case m_trace_record::Free:
+		{
+			std::unordered_map<uint64_t, size_t>::iterator block = blocks.find(record.m_addr);
+
+			if (block == blocks.end())
+			{
+				g_Replay.m_Skipped += 1;
+				continue;
+			}
+
+			call.m_Slot = block->second;
+			blocks.erase(block);
+			break;
+		}
+		case m_trace_record::Realloc:
+		{
+			// a failed realloc leaves the block as it was
+			if (!record.m_addr)
+				continue;
+
+			std::unordered_map<uint64_t, size_t>::iterator block = blocks.find(record.m_arg);
+
+			if (block == blocks.end())
+			{
+				g_Replay.m_Skipped += 1;
+				continue;
+			}
+
+			call.m_Slot = block->second;
+			blocks.erase(block);
+
+			blocks[record.m_addr] = call.m_Slot;
+			break;
+		}
+		default:
+			continue;
+		}
+
+		g_Replay.m_MaxSize = std::max(g_Replay.m_MaxSize, call.m_Size);
+		g_Replay.m_Calls.push_back(call);
+	}
+
+	fclose(file);
+
+	if (threaded && !workers.empty())
+		g_Replay.m_Workers = std::min<size_t>(workers.size(), Replay::MaxWorkers);
+
+	return true;
+}
+
+INLINE static void replay_call(Worker& worker, const ReplayCall& call, void** slots)
+{
+	switch (call.m_Op)
+	{
+	case m_trace_record::Malloc:
+		slots[call.m_Slot] = worker.malloc(call.m_Size);
+		break;
+
+	case m_trace_record::Free:
+		worker.free(slots[call.m_Slot]);
+		slots[call.m_Slot] = NULL;
+		break;
+
+	case m_trace_record::Realloc:
+		if (slots[call.m_Slot])
+		{
+			void* mem = worker.realloc(slots[call.m_Slot], call.m_Size);
+			if (mem)
+				slots[call.m_Slot] = mem;
+		}
+		break;
+	}
+}
+
+// the calls are made in the order of the trace: a worker waits for the
+// cursor to reach its next call, the worker making a call moves it on
+static void run_replay(std::vector<Worker>& workers, size_t scale)
+{
+	size_t count = workers.size();
+	size_t total = g_Replay.m_Calls.size();
+
+	std::vector<void*> slots(g_Replay.m_Slots, NULL);
+	std::vector<std::vector<size_t> > calls(count);
+
+	for (size_t i = 0; i < total; i++)
+		calls[g_Replay.m_Calls[i].m_Worker].push_back(i);
+
+	ATOMIC_VALUE(size_t) cursor(0);
+	Barrier barrier(count);
+
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < count; t++)
+	{
+		threads.push_back(std::thread([&, t]()
+		{
+			Worker& worker = workers[t];
+
+			barrier.wait();
+			worker.start();
+
+			for (size_t i = 0; i < calls[t].size(); i++)
+			{
+				size_t indx = calls[t][i];
+
+				if (count > 1)
+				{
+					while (cursor.load(std::memory_order_acquire) != indx)
+						std::this_thread::yield();
+				}
+
+				replay_call(worker, g_Replay.m_Calls[indx], slots.data());
+
+				if (count > 1)
+					cursor.store(indx + 1, std::memory_order_release);
+			}
+
+			worker.stop();
+		}));
+	}
+
+	for (size_t t = 0; t < count; t++)
+		threads[t].join();
+
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		if (slots[i])
+			workers[0].m_Heap->free(slots[i]);
+	}
+
+	(void)scale;
+}
+
+
+//===================================================================================
+//
+// report:
+
+static void report_header()
+{
+	printf("%-18s %-20s %7s %9s %8s %8s %8s %9s %6s\n", "workload", "allocator", "threads", "Mcalls/s", "p50 ns", "p99 ns", "p999 ns", "peak MB", "fails");
+}
+
+static uint32_t percentile(std::vector<uint32_t>& latency, double rank)
+{
+	if (latency.empty())
+		return 0;
+
+	size_t indx = static_cast<size_t>(rank * (latency.size() - 1));
+	std::nth_element(latency.begin(), latency.begin() + indx, latency.end());
+
+	return latency[indx];
+}
+
+// base is the resident memory before the allocator was constructed
+static void report_run(const Workload& workload, size_t heap, Heap& impl, size_t base, size_t threads, size_t scale)
+{
+	std::vector<Worker> workers(workload.m_Threaded ? threads : 1);
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].init(&impl, i, workload.m_Calls * scale);
+
+	ResidentSampler sampler;
+	workload.m_Run(workers, scale);
+	size_t peak = sampler.stop();
+
+	uint64_t begin = (uint64_t)-1, end = 0;
+	size_t   calls = 0, fails = 0, used = 0;
+
+	std::vector<uint32_t> latency;
+
+	// a worker which did not run (the odd one of the pairs) is not stopped
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		if (!workers[i].m_End)
+			continue;
+
+		begin  = std::min(begin, workers[i].m_Begin);
+		end    = std::max(end, workers[i].m_End);
+		calls += workers[i].m_Measured;
+		fails += workers[i].m_Fails;
+		used  += 1;
+
+		latency.insert(latency.end(), workers[i].m_Latency.begin(), workers[i].m_Latency.begin() + workers[i].m_Timed);
+	}
+
+	double seconds = (end > begin) ? (end - begin) * 1e-9 : 1e-9;
+	double rss     = (peak > base) ? (peak - base) / (1024.0 * 1024.0) : 0.0;
+
+	uint32_t p50  = percentile(latency, 0.5);
+	uint32_t p99  = percentile(latency, 0.99);
+	uint32_t p999 = percentile(latency, 0.999);
+
+	printf("%-18s %-20s %7zu %9.2f %8u %8u %8u %9.1f %6zu\n", workload.m_Name, g_Heaps[heap].m_Name, used, calls / seconds * 1e-6, p50, p99, p999, rss, fails);
+	fflush(stdout);
+}
+
+
+// the allocators are constructed on the stack, since BlockAllocator is
+// aligned beyond what operator new guarantees before C++17
+static void report_heap(const Workload& workload, size_t heap, size_t threads, size_t scale)
+{
+	size_t base = resident_size();
+
+	switch (heap)
+	{
+	case 0:
+	{
+		AllocatorHeap<BlockAllocator> impl(0);
+		report_run(workload, heap, impl, base, threads, scale);
+		break;
+	}
+	case 1:
+	{
+		AllocatorHeap<SmallBlockAllocator> impl(FixedPoolCapacity);
+		report_run(workload, heap, impl, base, threads, scale);
+		break;
+	}
+	case 2:
+	{
+		AllocatorHeap<LargeBlockAllocator> impl(FixedPoolCapacity);
+		report_run(workload, heap, impl, base, threads, scale);
+		break;
+	}
+	case 3:
+	{
+		SystemHeap impl;
+		report_run(workload, heap, impl, base, threads, scale);
+		break;
+	}
+#if BENCH_NEDMALLOC
+	case 4:
+	{
+		NedHeap impl;
+		report_run(workload, heap, impl, base, threads, scale);
+		break;
+	}
+#endif
+	}
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+	size_t threads = std::thread::hardware_concurrency();
+	size_t scale   = 1;
+
+	if (threads < 2)
+		threads = 2;
+
+	// SmallBlockAllocator and LargeBlockAllocator have 16 pools
+	if (threads > 8)
+		threads = 8;
+
+	if (argc > 2 && strcmp(argv[1], "replay") == 0)
+	{
+		bool threaded = argc > 3 && strcmp(argv[3], "threaded") == 0;
+
+		if (!replay_load(argv[2], threaded))
+		{
+			fprintf(stderr, "%s is not a trace\n", argv[2]);
+			return 1;
+		}
+
+		printf("%zu calls, %zu blocks, %zu calls on the blocks allocated before the trace left out\n", g_Replay.m_Calls.size(), g_Replay.m_Slots, g_Replay.m_Skipped);
+
+		if (g_Replay.m_Merged)
+			printf("the trace ran out of the thread numbers, the threads past %u are replayed as one\n", (unsigned)m_trace_record::MaxThread - 1);
+
+		printf("\n");
+
+		Workload replay = { "replay", g_Replay.m_MaxSize, threaded, g_Replay.m_Calls.size(), run_replay };
+
+		report_header();
+
+		for (size_t h = 0; h < sizeof(g_Heaps) / sizeof(g_Heaps[0]); h++)
+		{
+			if (replay.m_MaxSize > g_Heaps[h].m_MaxSize)
+				continue;
+
+			report_heap(replay, h, g_Replay.m_Workers, 1);
+		}
+
+		return 0;
+	}
+
+	if (argc > 1)
+		threads = std::max(2, std::min(8, atoi(argv[1])));
+
+	if (argc > 2)
+		scale = std::max(1, atoi(argv[2]));
+
+	report_header();
+
+	for (size_t w = 0; w < sizeof(g_Workloads) / sizeof(g_Workloads[0]); w++)
+	{
+		for (size_t h = 0; h < sizeof(g_Heaps) / sizeof(g_Heaps[0]); h++)
+		{
+			if (g_Workloads[w].m_MaxSize > g_Heaps[h].m_MaxSize)
+				continue;
+
+			report_heap(g_Workloads[w], h, threads, scale);
+		}
+	}
+
+	return 0;
+}
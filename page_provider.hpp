@@ -0,0 +1,139 @@
+#pragma once
+//===================================================================================
+//
+// externals:
+
+#include "common.hpp"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+//===================================================================================
+//
+// publics:
+
+// Page provider is a thin layer over the virtual memory api of the OS; it hands
+// out page aligned regions to the memory pools. Fresh regions are zero filled
+// by the OS, so the pools never have to clear them on construction.
+
+// the granularity the regions are allocated with
+INLINE size_t page_granularity()
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	::GetSystemInfo(&info);
+
+	return info.dwAllocationGranularity;
+#else
+	return static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// maps a new read/write region of the specified size
+INLINE void* page_alloc(size_t size)
+{
+#if defined(_WIN32)
+	return ::VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* memory = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (memory != MAP_FAILED) ? memory : NULL;
+#endif
+}
+
+// unmaps the region previously returned by page_alloc or page_reserve
+INLINE void page_free(void* memory, size_t size)
+{
+#if defined(_WIN32)
+	::VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	::munmap(memory, size);
+#endif
+}
+
+// reserves an address range of the specified size without backing it by memory;
+// pages of the range have to be committed before they are accessed
+INLINE void* page_reserve(size_t size)
+{
+#if defined(_WIN32)
+	return ::VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void* memory = ::mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return (memory != MAP_FAILED) ? memory : NULL;
+#endif
+}
+
+// reserves an address range of the specified size aligned to the specified
+// power of two, which is a multiple of the granularity
+INLINE void* page_reserve_aligned(size_t size, size_t alignment)
+{
+#if defined(_WIN32)
+	// a range large enough is reserved to find the aligned address in it, and
+	// then it is released to reserve the aligned range; another thread may
+	// take the address meanwhile, so it is tried again
+	for (;;)
+	{
+		char* memory = static_cast<char*>(::VirtualAlloc(0, size + alignment, MEM_RESERVE, PAGE_NOACCESS));
+		if (!memory)
+			return NULL;
+
+		char* aligned = reinterpret_cast<char*>((reinterpret_cast<size_t>(memory) + alignment - 1) & ~(alignment - 1));
+
+		::VirtualFree(memory, 0, MEM_RELEASE);
+
+		memory = static_cast<char*>(::VirtualAlloc(aligned, size, MEM_RESERVE, PAGE_NOACCESS));
+		if (memory)
+			return memory;
+	}
+#else
+	// the excess before and after the aligned range is unmapped
+	char* memory = static_cast<char*>(page_reserve(size + alignment));
+	if (!memory)
+		return NULL;
+
+	char* aligned = reinterpret_cast<char*>((reinterpret_cast<size_t>(memory) + alignment - 1) & ~(alignment - 1));
+
+	if (aligned > memory)
+		::munmap(memory, aligned - memory);
+
+	if (aligned + size < memory + size + alignment)
+		::munmap(aligned + size, memory + alignment - aligned);
+
+	return aligned;
+#endif
+}
+
+// backs the pages of a reserved range by memory and makes them read/write
+INLINE bool page_commit(void* memory, size_t size)
+{
+#if defined(_WIN32)
+	return ::VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+	return ::mprotect(memory, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// moves the committed pages at the beginning of a range to the beginning of
+// another reserved range without copying them, the source pages are unmapped;
+// returns false if the OS cannot move pages (the caller copies them then)
+INLINE bool page_remap(void* memory, size_t size, void* target)
+{
+#if defined(__linux__)
+	return ::mremap(memory, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, target) != MAP_FAILED;
+#else
+	return false;
+#endif
+}
+
+// returns the pages of a committed range to the OS, the range stays reserved;
+// the pages read back as zero once they are committed again
+INLINE void page_decommit(void* memory, size_t size)
+{
+#if defined(_WIN32)
+	::VirtualFree(memory, size, MEM_DECOMMIT);
+#else
+	::mmap(memory, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+}
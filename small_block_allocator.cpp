@@ -2,7 +2,10 @@
 //
 // externals:
 
+#include <string.h>
+
 #include "small_block_allocator.hpp"
+#include "page_provider.hpp"
 
 //===================================================================================
 //
@@ -10,10 +13,10 @@
 
 namespace Small
 {
-	struct m_ctrl_block;
+	struct m_slab_run;
 	struct m_pool_local;
 
-	using  p_ctrl_block = m_ctrl_block*;
+	using  p_slab_run   = m_slab_run*;
 	using  p_pool_local = m_pool_local*;
 
 }; //namespace Small
@@ -24,85 +27,81 @@ namespace Small
 
 namespace Small
 {
-	// This is a data structure which is used as a "service" header for user memory
-	// block. 
-	struct m_ctrl_block
+	// This is a data structure which is used as a "service" header of a slab
+	// run: a page carved from a pool and split into the objects of one size
+	// class. The objects carry no header of their own, the run and the pool
+	// they belong to are found from the page address.
+	struct m_slab_run
 	{
-		size_t       m_head; // stores the size of the previos memory block
-		size_t       m_data; // stores the size of the current memory block + 
-							 // 2 less significant bits used as flags: whether
-							 // the current block and the previous block are in use
-
-		p_pool_local m_pool; // parent memory pool
-
-		p_ctrl_block m_next; // next block in the linked list (if the blocked cached in the bins array)
-		p_ctrl_block m_prev; // previoius block in the linked list (if the blocked cached in the bins array)
-
-		DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_ctrl_block);
-
-		INLINE p_pool_local pool()
+		enum
 		{
-			return m_pool;
-		}
+			RunSize  = 0x1000, // runs are page sized and page aligned
+			HeadSize = 0x40    // the objects start at this offset, aligned to 16 bytes at least
+		};
 
-		INLINE void pool(p_pool_local pool)
-		{
-			m_pool = pool;
-		}
+		p_pool_local m_pool; // parent memory pool
 
-		INLINE size_t head()
-		{
-			return m_head;
-		}
+		p_slab_run   m_next; // next run in the list of the runs of the class with free objects (or of the empty runs)
+		p_slab_run   m_prev; // previous run in that list
 
-		INLINE void head(size_t head)
-		{
-			m_head = head;
-		}
+		void*        m_free; // intrusive list of the freed objects
+		char*        m_bump; // the objects above this address have never been handed out
 
-		INLINE size_t size()
-		{
-			return m_data & (~CBit) & (~PBit);
-		}
+		size_t       m_size; // size of the objects of the run
+		size_t       m_indx; // index of the size class
+		size_t       m_used; // number of the objects in use
 
-		INLINE void size(size_t size)
-		{
-			m_data = (m_data & (CBit | PBit)) | (size & (~CBit) & (~PBit));
-		}
+		DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_slab_run);
 
-		INLINE size_t pbit() // flag, whether the previous control memory block is in use
+		INLINE void init(p_pool_local pool, size_t indx, size_t size)
 		{
-			return m_data & PBit;
+			m_pool = pool;
+			m_next = NULL;
+			m_prev = NULL;
+			m_free = NULL;
+			m_bump = add_mem<char*>(this, HeadSize);
+			m_size = size;
+			m_indx = indx;
+			m_used = 0;
 		}
 
-		INLINE size_t cbit() // flag, whether the current control memory block is in use
+		// pops an object off the free list, or takes the next object never
+		// handed out; the page is touched only as the objects are used
+		INLINE void* malloc()
 		{
-			return m_data & CBit;
-		}
+			void* mem = m_free;
 
-		INLINE void turn(size_t bit)
-		{
-			m_data |= bit;
-		}
+			if (mem)
+			{
+				m_free = *static_cast<void**>(mem);
+			}
+			else if (m_bump + m_size <= add_mem<char*>(this, RunSize))
+			{
+				mem = m_bump;
+				m_bump += m_size;
+			}
+			else
+			{
+				return NULL;
+			}
 
-		INLINE void drop(size_t bit)
-		{
-			m_data &= ~bit;
+			m_used += 1;
+			return mem;
 		}
 
-		INLINE p_ctrl_block next_blck()
+		// pushes the object to the free list
+		INLINE void free(void* mem)
 		{
-			return add_mem<p_ctrl_block>(this, size());
-		}
+			*static_cast<void**>(mem) = m_free;
+			m_free = mem;
 
-		INLINE p_ctrl_block prev_blck()
-		{
-			return sub_mem<p_ctrl_block>(this, head());
+			m_used -= 1;
 		}
 
-		INLINE void* user_blck()
+		// whether there are no objects to hand out
+		INLINE bool full()
 		{
-			return reinterpret_cast<char*>(this) + sizeof(m_ctrl_block);
+			return !m_free && (m_bump + m_size > add_mem<char*>(this, RunSize));
 		}
 	};
 
@@ -113,11 +112,11 @@ namespace Small
 
 namespace Small
 {
-	// this routine is used to convert user memory to allocator internal control 
-	// memory block
-	INLINE static p_ctrl_block mem_to_blk(void* mem)
+	// this routine is used to convert user memory to the slab run
+	// holding it
+	INLINE static p_slab_run mem_to_run(void* mem)
 	{
-		return sub_mem<p_ctrl_block>(mem, sizeof(m_ctrl_block));
+		return reinterpret_cast<p_slab_run>(reinterpret_cast<size_t>(mem) & ~(size_t)(m_slab_run::RunSize - 1));
 	}
 
 }; //namespace Small
@@ -132,215 +131,158 @@ namespace Small
 	{
 		enum
 		{
-			Count = 32,			
+			Count = 32,
 			MaxUserReqSize = 256
 		};
 
 		LOCK         m_lock; // mutex to lock the whole pool
-		p_ctrl_block m_foot; // free control memory block which is used to allocate new memory blocks
+		size_t       m_size; // size of the memory region owned by the pool
+		char*        m_foot; // the runs are carved from here up to the end of the region
 
-		uint32_t     m_bits; // binary map used to indicate what bins are in the use
-		m_ctrl_block m_bins[Count]; // array of linked lists used to cache already freed memory blocks
+		p_slab_run   m_empty; // list of the runs with no objects in use, they are taken by any class
+		p_slab_run   m_runs[Count]; // array of lists of the runs with free objects, one per size class
 
 		p_pool_local m_next; // link to next memory pool in this allocator
 		DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_pool_local);
 
 		INLINE void init(size_t foot_size)
 		{
-			m_bits = 0;
-			m_lock.mutex::mutex();
+			m_size = foot_size;
+			new (&m_lock) LOCK();
+
+			// the runs follow the pool header, page aligned
+			m_foot = reinterpret_cast<char*>(this) + ((sizeof(m_pool_local) + m_slab_run::RunSize - 1) & ~(size_t)(m_slab_run::RunSize - 1));
 
-			m_foot = add_mem<p_ctrl_block>(this, sizeof(m_pool_local));
-			m_foot->size(foot_size - sizeof(m_pool_local));
-			m_foot->turn(PBit);
+			m_empty = NULL;
 
-			// init list bins
 			for (size_t i = 0; i < Count; i++)
-				m_bins[i].m_next = m_bins[i].m_prev = bins_blck(i);
+				m_runs[i] = NULL;
 		}
 
 		INLINE void fini()
 		{
 			for (size_t i = 0; i < Count; i++)
 			{
-				assert(m_bins[i].m_next == m_bins[i].m_prev);
-				assert(m_bins[i].m_next == bins_blck(i));
+				for (p_slab_run run = m_runs[i]; run; run = run->m_next)
+					assert(run->m_used == 0);
 			}
-			assert(m_foot == add_mem<p_ctrl_block>(this, sizeof(m_pool_local)));
 		}
 
-		// this routine tries to allocate memory block; 
-		// first it looks to the binary maps for suitable memory block,
-		// and later if there is enough memory is allocates a new block
-		// from the foots
+		// this routine tries to allocate memory block; it pops an object
+		// of the run at the head of the list of the size class, a new run
+		// is taken for the class when the list is empty
 		void* malloc(size_t bytesreq)
 		{
-			if (!m_lock.try_lock())
-				return VOID_0;
-			
 			if (bytesreq >= MaxUserReqSize)
 				return VOID_1;
 
+			if (!m_lock.try_lock())
+				return VOID_0;
+
 			void* mem = NULL;
 
-			size_t size = (bytesreq + sizeof(m_ctrl_block) + 0x7) & ~0x7; //adjusting the size to double word boundary
-			size_t indx = size >> 3;
+			size_t indx = runs_indx(bytesreq);
+
+			p_slab_run run = m_runs[indx];
+			if (run == NULL)
+				run = runs_create(indx);
 
-			size_t bit = m_bits >> indx;
-			if (bit & 0x0000001)
+			if (run != NULL)
 			{
-				mem = bins_malloc(size);
+				mem = run->malloc();
+
+				if (run->full())
+					pull_run(&m_runs[indx], run);
 			}
-			else if (size < m_foot->size())
-			{
-				mem = foot_malloc(size);
-			}			
 
 			m_lock.unlock();
 			return mem != NULL ? mem : VOID_1;
 		}
 
-		// this routine releases allocated memory block; it tries to coalesce
-		// it with the previous or the next block, and then caches the result
-		// in the binary map
-		void free(void* p)
+		// this routine releases allocated memory block; a full run goes
+		// back to the list of its class, an empty one is given to the
+		// other classes unless it is the only run of its class
+		void free(p_slab_run run, void* p)
 		{
 			SCOPE_LOCK(m_lock);
 
-			p_ctrl_block curr_b = mem_to_blk(p);
-			size_t       curr_s = curr_b->size();
-
-			assert(curr_b->pool() == this);
-
-			if (!curr_b->cbit())
-				return;
+			assert(run->m_pool == this);
 
-			p_ctrl_block next_b = curr_b->next_blck();
-			size_t       next_s = next_b->size();
-
-			if (!curr_b->pbit()) //coalesce with previous block
-			{
-				size_t       prev_s = curr_b->head();
-				p_ctrl_block prev_b = curr_b->prev_blck();
+			bool full = run->full();
 
-				pull_binblk(prev_b);
+			run->free(p);
 
-				curr_b = prev_b;
-				curr_s += prev_s;
-			}
+			if (full)
+				push_run(&m_runs[run->m_indx], run);
 
-			if (!next_b->cbit()) //coalesce with next block
+			if (run->m_used == 0 && (run->m_next || run->m_prev))
 			{
-				curr_s += next_s;
-
-				if (next_b == m_foot)
-				{
-					m_foot = curr_b;
-					m_foot->size(curr_s);
-					m_foot->turn(PBit);
-					m_foot->drop(CBit);
-
-					return;
-				}
-				else
-				{
-					pull_binblk(next_b);
-				}
+				pull_run(&m_runs[run->m_indx], run);
+				push_run(&m_empty, run);
 			}
-
-			curr_b->drop(CBit);
-			curr_b->size(curr_s);
-			curr_b->next_blck()->drop(PBit);
-			curr_b->next_blck()->head(curr_s);
-
-			push_binblk(curr_b);
-		}
-
-		INLINE p_ctrl_block bins_blck(size_t indx)
-		{
-			assert(indx < Count);
-			return &m_bins[indx];
 		}
 
-		// the index in the array of linked lists; 
-		// map size value to the array of 32 bins;
-		INLINE size_t bins_indx(size_t size)
+		// the index of the size class; the classes are 8 bytes apart
+		INLINE size_t runs_indx(size_t bytesreq)
 		{
-			return size >> 3;
-		}
-
-		// takes the first block in the specified linked list
-		INLINE void* bins_malloc(size_t size)
-		{
-			size_t indx = bins_indx(size);
-			assert((bins_blck(indx)->m_next != bins_blck(indx)) && (bins_blck(indx)->m_prev != bins_blck(indx)));
-
-			p_ctrl_block blck = bins_blck(indx)->m_next;
-
-			blck->pool(this);
-			blck->turn(CBit);
-			blck->turn(PBit);
-
-			pull_binblk(blck);
-			return blck->user_blck();
+			return (bytesreq != 0) ? (bytesreq - 1) >> 3 : 0;
 		}
 
-		// allocates a new memory block on the foot
-		INLINE void* foot_malloc(size_t size)
+		// takes an empty run, or carves a new one from the foot,
+		// and hands it to the specified size class
+		INLINE p_slab_run runs_create(size_t indx)
 		{
-			size_t rest = m_foot->size() - size;
+			p_slab_run run = m_empty;
 
-			p_ctrl_block blck = m_foot;
-			blck->pool(this);
-			blck->size(size);
-			blck->turn(CBit);
+			if (run != NULL)
+			{
+				pull_run(&m_empty, run);
+			}
+			else if (m_foot + m_slab_run::RunSize <= reinterpret_cast<char*>(this) + m_size)
+			{
+				run = reinterpret_cast<p_slab_run>(m_foot);
+				m_foot += m_slab_run::RunSize;
+			}
+			else
+			{
+				return NULL;
+			}
 
-			m_foot = blck->next_blck();
-			m_foot->size(rest);
-			m_foot->head(size);
-			m_foot->turn(PBit);
-			m_foot->drop(CBit);
+			run->init(this, indx, (indx + 1) << 3);
+			push_run(&m_runs[indx], run);
 
-			return blck->user_blck();
+			return run;
 		}
 
-		// add memory block to the specified linked list
-		INLINE void push_binblk(p_ctrl_block blck)
+		// add the run to the specified list
+		INLINE void push_run(p_slab_run* list, p_slab_run run)
 		{
-			size_t size = blck->size();
-			size_t indx = bins_indx(size);
+			run->m_prev = NULL;
+			run->m_next = *list;
 
-			assert(indx < Count);
+			if (*list)
+				(*list)->m_prev = run;
 
-			p_ctrl_block prev = bins_blck(indx);
-			p_ctrl_block next = prev;
-
-			prev->m_next = blck;
-			next->m_prev = blck;
-			blck->m_next = next;
-			blck->m_prev = prev;
-
-			m_bits |= ((size_t)1 << indx);
+			*list = run;
 		}
 
-		// remove memory block from the specified linked list
-		INLINE void pull_binblk(p_ctrl_block blck)
+		// remove the run from the specified list
+		INLINE void pull_run(p_slab_run* list, p_slab_run run)
 		{
-			p_ctrl_block lblk = static_cast<p_ctrl_block>(blck);
-
-			size_t size = lblk->size();
-			size_t indx = bins_indx(size);
-
-			assert(indx < Count);
-
-			p_ctrl_block next = blck->m_next;
-			p_ctrl_block prev = blck->m_prev;
+			if (run->m_prev)
+			{
+				run->m_prev->m_next = run->m_next;
+			}
+			else
+			{
+				*list = run->m_next;
+			}
 
-			if (next == prev) // drop bits
-				m_bits &= ~((size_t)1 << indx);
+			if (run->m_next)
+				run->m_next->m_prev = run->m_prev;
 
-			next->m_prev = prev;
-			prev->m_next = next;
+			run->m_next = NULL;
+			run->m_prev = NULL;
 		}
 	};
 
@@ -357,6 +299,9 @@ namespace Small
 BlockAllocator::BlockAllocator(size_t thread_local_capacity)
 	: m_ThreadCount(0)
 {
+	if (!thread_local_capacity)
+		thread_local_capacity = DefaultCapacity;
+
 	for (size_t i = 0; i < MaxThreadCount; i++)
 	{
 		m_ThreadPool[i] = pool_construct(thread_local_capacity);
@@ -428,11 +373,43 @@ void BlockAllocator::free(void* umem)
 	if (!umem)
 		return;
 
-	p_ctrl_block blck = mem_to_blk(umem);
-	p_pool_local pool = blck->pool();
+	p_slab_run   run  = mem_to_run(umem);
+	p_pool_local pool = run->m_pool;
 
 	if (pool)
-		pool->free(umem);
+		pool->free(run, umem);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+
+void* BlockAllocator::realloc(void* umem, size_t size)
+{
+	if (!umem)
+		return malloc(size);
+
+	if (!size)
+	{
+		free(umem);
+		return NULL;
+	}
+
+	p_slab_run run = mem_to_run(umem);
+
+	// the object stays in place while the size class does not change,
+	// otherwise it is moved to an object of the new class
+	if (size < m_pool_local::MaxUserReqSize && run->m_pool->runs_indx(size) == run->m_indx)
+		return umem;
+
+	void* mem = malloc(size);
+	if (mem)
+	{
+		size_t used = run->m_size;
+		memcpy(mem, umem, (used < size) ? used : size);
+
+		free(umem);
+	}
+
+	return mem;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
@@ -441,18 +418,13 @@ p_pool_local BlockAllocator::pool_construct(size_t capacity)
 {
 	p_pool_local pool = NULL;
 
-	SYSTEM_INFO info;
-	::GetSystemInfo(&info);
-
-	size_t gran = info.dwAllocationGranularity;
+	size_t gran = page_granularity();
 	size_t size = (capacity + (gran << 1) - 1) & ~(gran - 1); // align capacity to granularity size
 
-	void* memory = ::VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	void* memory = page_alloc(size);
 	if (!memory)
 		return NULL;
 
-	::ZeroMemory(memory, size);
-
 	pool = static_cast<p_pool_local>(memory);
 	pool->init(size);
 
@@ -466,14 +438,14 @@ void BlockAllocator::pool_destruct(p_pool_local pool)
 	if (pool)
 	{
 		pool->fini();
-		::VirtualFree(pool, 0, MEM_RELEASE);
+		page_free(pool, pool->m_size);
 	}
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 
-uint16_t BlockAllocator::m_ThreadIndex = (uint16_t)-1;
+THREAD_LOCAL_DEF(uint16_t) BlockAllocator::m_ThreadIndex = (uint16_t)-1;
 
 }; //namespace Small
 
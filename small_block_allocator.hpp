@@ -12,8 +12,10 @@
 namespace Small
 {
 
-// SmallBlockAllocator can manage memory pools 
-// of small blocks and large blocks
+// SmallBlockAllocator serves the requests below 256 bytes from slab runs:
+// pages of the thread local memory pools dedicated to one size class each
+// (the classes are 8 bytes apart); the objects carry no header, the run and
+// the pool of an object are found from its page address.
 class BlockAllocator
 {
 public:
@@ -23,10 +25,13 @@ public:
 	void* malloc(size_t size);
 	void  free(void* umem);
 
+	void* realloc(void* umem, size_t size);
+
 private:
 	enum 
 	{
-		MaxThreadCount = 0x10
+		MaxThreadCount  = 0x10,
+		DefaultCapacity = 0x100000
 	};
 
 	using p_pool_local = struct m_pool_local*;
@@ -0,0 +1,227 @@
+#pragma once
+//===================================================================================
+//
+// externals:
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "common.hpp"
+#include "page_provider.hpp"
+
+
+//===================================================================================
+//
+// publics:
+
+// A record describes a call of the allocator. The records are in the order
+// the calls were made over all the threads: an allocation is recorded once
+// it returns, a free before it is done, so a block is allocated before it is
+// freed and freed before its address is allocated again.
+struct m_trace_record
+{
+	enum
+	{
+		Malloc        = 1, // m_addr = malloc(m_size)
+		Free          = 2, // free(m_addr), m_size is the one passed to free_sized or 0
+		Realloc       = 3, // m_addr = realloc(m_arg, m_size)
+		AlignedMalloc = 4  // m_addr = aligned_malloc(m_arg, m_size)
+	};
+
+	static const uint64_t MaxSize   = ((uint64_t)1 << 40) - 1; // the larger sizes are recorded as this one
+	static const uint32_t MaxThread = ((uint32_t)1 << 24) - 1; // the threads seen after it share its number
+
+	uint64_t m_time   : 60; // nanoseconds since the trace started
+	uint64_t m_op     : 4;
+	uint64_t m_addr;        // the block allocated or freed, 0 if an allocation failed
+	uint64_t m_arg;         // the block resized by realloc, the alignment of aligned_malloc
+	uint64_t m_size   : 40; // the bytes requested, or passed to free_sized
+	uint64_t m_thread : 24; // number of the calling thread, from 1 up in the order the threads were seen
+};
+
+static_assert(sizeof(m_trace_record) == 32, "the records are 32 bytes");
+
+// The trace file starts with this header, the records follow it up to the end
+// of the file; all the fields are little endian.
+struct m_trace_header
+{
+	enum
+	{
+		Version = 2
+	};
+
+	char     m_magic[8];  // "BLKTRACE"
+	uint32_t m_version;   // Version
+	uint32_t m_record;    // size of a record, sizeof(m_trace_record)
+
+	INLINE void init()
+	{
+		memcpy(m_magic, "BLKTRACE", sizeof(m_magic));
+
+		m_version = Version;
+		m_record  = sizeof(m_trace_record);
+	}
+
+	INLINE bool valid()
+	{
+		return memcmp(m_magic, "BLKTRACE", sizeof(m_magic)) == 0 && m_version == Version && m_record == sizeof(m_trace_record);
+	}
+};
+
+// The recorder writes the calls of an allocator into a trace file. The records
+// are collected into a buffer under the lock of the recorder, which is written
+// to the file whenever it fills up; so the recording serializes the calls of
+// the threads. The buffer lives in pages of its own and the file is written by
+// the C runtime, the allocator is never used by the recorder.
+struct m_trace_recorder
+{
+	enum
+	{
+		BufferCount = 0x2000 // records buffered before they are written
+	};
+
+	LOCK     m_lock;  // guards the file and the buffer
+	FILE*    m_file;  // NULL while the recorder is closed
+	uint64_t m_start; // the time the trace started at
+	size_t   m_count; // records in the buffer
+	bool     m_failed; // whether any records could not be written since the trace started
+
+	m_trace_record m_records[BufferCount];
+
+	// the recorder is placed into fresh pages, which are zero filled
+	INLINE static m_trace_recorder* create()
+	{
+		m_trace_recorder* recorder = static_cast<m_trace_recorder*>(page_alloc(sizeof(m_trace_recorder)));
+
+		if (recorder)
+			new (&recorder->m_lock) LOCK();
+
+		return recorder;
+	}
+
+	INLINE static void destroy(m_trace_recorder* recorder)
+	{
+		if (recorder)
+		{
+			recorder->close();
+			page_free(recorder, sizeof(m_trace_recorder));
+		}
+	}
+
+	INLINE static uint64_t clock()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// the threads are numbered once, the same for all the recorders; the
+	// numbers stop at MaxThread rather than wrap around, so the threads past
+	// it share one number (the replay reports it) instead of taking the
+	// numbers of the first ones
+	INLINE static uint32_t thread_id()
+	{
+		static ATOMIC_VALUE(uint32_t) count(0);
+		THREAD_LOCAL(uint32_t) indx;
+
+		if (!indx)
+		{
+			uint32_t next = count.load(std::memory_order_relaxed);
+
+			while (next < m_trace_record::MaxThread && !count.compare_exchange_weak(next, next + 1, std::memory_order_relaxed))
+				;
+
+			indx = (next < m_trace_record::MaxThread) ? next + 1 : m_trace_record::MaxThread;
+		}
+
+		return indx;
+	}
+
+	// starts a new trace, the one being written is finished first
+	bool open(const char* path)
+	{
+		FILE* file = fopen(path, "wb");
+		if (!file)
+			return false;
+
+		m_trace_header header;
+		header.init();
+
+		if (fwrite(&header, sizeof(header), 1, file) != 1)
+		{
+			fclose(file);
+			return false;
+		}
+
+		close();
+
+		SCOPE_LOCK(m_lock);
+
+		m_file   = file;
+		m_start  = clock();
+		m_count  = 0;
+		m_failed = false;
+
+		return true;
+	}
+
+	// writes the rest of the records and closes the file; returns false if
+	// any of the records could not be written
+	bool close()
+	{
+		SCOPE_LOCK(m_lock);
+
+		if (!m_file)
+			return true;
+
+		flush();
+
+		bool done = (fclose(m_file) == 0) && !m_failed;
+		m_file = NULL;
+
+		return done;
+	}
+
+	// this routine is used by every call of the allocator while the trace is
+	// being written; the calls racing the close of the trace are dropped
+	void record(uint32_t op, void* addr, size_t size, size_t arg)
+	{
+		uint32_t thread = thread_id();
+
+		SCOPE_LOCK(m_lock);
+		append(op, addr, size, arg, thread);
+	}
+
+	// the lock is held by the caller; a call which frees a block and then
+	// allocates one (realloc) holds it over the call, so that no other thread
+	// records the address freed as allocated before the call is recorded
+	void append(uint32_t op, void* addr, size_t size, size_t arg, uint32_t thread)
+	{
+		if (!m_file)
+			return;
+
+		m_trace_record* record = &m_records[m_count++];
+
+		record->m_time   = clock() - m_start;
+		record->m_addr   = reinterpret_cast<size_t>(addr);
+		record->m_arg    = arg;
+		record->m_size   = (size < m_trace_record::MaxSize) ? size : m_trace_record::MaxSize;
+		record->m_thread = thread;
+		record->m_op     = op;
+
+		if (m_count == BufferCount)
+			flush();
+	}
+
+	// the lock is held by the caller; a failure sticks until the next trace,
+	// so that close reports the buffers lost in the middle of the trace too
+	void flush()
+	{
+		size_t count = m_count;
+		m_count = 0;
+
+		if (fwrite(m_records, sizeof(m_trace_record), count, m_file) != count)
+			m_failed = true;
+	}
+
+	DELETE_CONSTRUCTOR_AND_DESTRUCTOR(m_trace_recorder);
+};